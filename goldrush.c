@@ -23,10 +23,16 @@
 #ifdef GR_HAVE_PERFCTR
 #include "gr_perfctr.h"
 #include "gr_monitor_buffer.h"
+#include "gr_node_monitor.h"
 #include "gr_stub.h"
 #endif
 
 #include "gr_phase.h"
+#include "gr_predict.h"
+#include "gr_profile.h"
+#include "gr_overhead.h"
+#include "gr_intern.h"
+#include "gr_discover.h"
 
 /* changed by Chao for kitten, using kitten scheduler API 
    for suspend operation 
@@ -45,13 +51,9 @@ int gr_local_rank;
 int gr_local_size;
 int is_simulation;
 
-unsigned long int current_phase_file;
-unsigned int current_phase_line;
-uint64_t current_phase_start_time;
-long long current_phase_perfctr_values[NUM_EVENTS];
+// the phase currently open on the main thread, published by the stub. The
+// rest of the phase state lives in per-thread phase contexts (gr_phase.h).
 int current_phase_id = 0;
-int is_resumed = 0;
-int has_start_phase = 0;
 int is_in_mainloop = 0;
 
 
@@ -61,6 +63,10 @@ gr_shm_layout_t gr_shm_meta = NULL;
 #ifdef GR_HAVE_PERFCTR
 df_shm_region_t gr_mon_buffer_region = NULL;
 gr_mon_buffer_t gr_monitor_buffer = NULL;
+// shared by all simulation ranks on the node, created by the local leader
+df_shm_region_t gr_node_monitor_region = NULL;
+gr_node_mon_t gr_node_monitor = NULL;
+int gr_node_mon_threads = GR_NODE_MONITOR_DEFAULT_THREADS; // slots per rank
 #endif
 
 
@@ -71,8 +77,23 @@ char *gr_meta_region_posix_name = "/gr_meta_region";
 
 int gr_do_suspend = 1;
 int gr_do_phase_perfctr = 1;
-int min_phase_length = 0; //2000083; // 1 ms for smoky
+uint64_t min_phase_length = 0; // in ns, e.g. 1000000 for 1 ms
+double gr_resume_quantile = -1; // < 0: compare the mean phase length
+int gr_do_predict = 1;
+uint64_t gr_predict_max_gap = 0; // longest gap merged into an idle window, in ns
+double gr_predict_min_confidence = 0.8;
+int gr_predict_depth = 4;
+int gr_adaptive_sampling = 0;
+double gr_adaptive_rvar = 0.01; // relative variance below which a phase is stable
+uint32_t gr_adaptive_max_stride = 64;
+uint32_t gr_adaptive_min_samples = 32;
+double gr_adaptive_drift = 3; // drift: more than this many stddevs off the mean
+char *gr_phase_profile = NULL; // path prefix of the phase profile files
+int gr_phase_profile_max_age = GR_PROFILE_DEFAULT_MAX_AGE;
 int gr_do_stub = 1;
+int gr_subtract_overhead = 1; // subtract instrumentation overhead from phase lengths
+uint64_t gr_snapshot_max_age = 1000; // a phase start reuses counters read this recently, in ns
+int gr_do_discover = 0; // find phases by sampling the instruction pointer
 
 #ifdef DEBUG_TIMING
 /* dump timing results */
@@ -107,6 +128,103 @@ void gr_get_application_id(int *id)
     *id = gr_app_id;
 }
 
+/*
+ * Set up the shared memory between the simulation and analytics on this
+ * node. The local leader of the simulation creates the meta-data region,
+ * the other simulation ranks and the analytics attach to it.
+ *
+ * Return 0 for success and -1 for error.
+ */
+static int gr_init_shm()
+{
+    gr_shm_handle = df_shm_init(CHOSEN_SHM_METHOD, NULL);
+    if(!gr_shm_handle) {
+        fprintf(stderr, "Error: cannot initialize shared memory. %s:%d\n", 
+            __FILE__, __LINE__);
+        return -1;
+    }
+    void *meta_region_name = (void *) &gr_meta_region_key;
+    int meta_region_name_size = sizeof(gr_meta_region_key);
+    size_t meta_region_size = gr_get_shm_meta_region_size();
+    if(gr_is_local_leader()) {
+        gr_shm_meta_region = df_create_named_shm_region(gr_shm_handle,
+            meta_region_name, meta_region_name_size, meta_region_size, NULL);
+        if(gr_shm_meta_region && gr_init_shm_meta_region(gr_shm_meta_region)) {
+            df_destroy_shm_region(gr_shm_meta_region);
+            gr_shm_meta_region = NULL;
+        }
+    }
+    if(is_simulation) {
+        // the other ranks attach once the leader has created it
+        MPI_Barrier(gr_comm);
+    }
+    while(!gr_is_local_leader()) {
+        gr_shm_meta_region = df_attach_named_shm_region(gr_shm_handle,
+            meta_region_name, meta_region_name_size, meta_region_size, NULL);
+        if(gr_shm_meta_region || is_simulation) {
+            break;
+        }
+        // analytics wait until the simulation is up
+        sleep(1);
+    }
+    if(!gr_shm_meta_region) {
+        fprintf(stderr, "Error: cannot set up shm meta-data region. %s:%d\n", 
+            __FILE__, __LINE__);
+        df_shm_finalize(gr_shm_handle);
+        gr_shm_handle = NULL;
+        return -1;
+    }
+    gr_shm_meta = (gr_shm_layout_t) gr_shm_meta_region->starting_addr;
+    return 0;
+}
+
+#ifdef GR_HAVE_PERFCTR
+/*
+ * Register the simulation as a sender, so analytics find the monitor 
+ * buffers of its ranks. Called by all simulation ranks once their 
+ * buffers are created.
+ */
+static void gr_register_sender()
+{
+    MPI_Barrier(gr_comm);
+    if(!gr_is_local_leader()) {
+        return;
+    }
+    if(gr_local_size > GR_MAX_NUM_PROCS) {
+        fprintf(stderr, "Error: more than %d ranks per node. %s:%d\n", 
+            GR_MAX_NUM_PROCS, __FILE__, __LINE__);
+        return;
+    }
+    sem_wait(&gr_shm_meta->sem);
+    if(gr_shm_meta->num_senders < GR_MAX_NUM_SENDERS) {
+        gr_sender_t s = &(gr_shm_meta->senders[gr_shm_meta->num_senders]);
+        s->app_id = gr_app_id;
+        s->num_procs = gr_local_size;
+        int i;
+        for(i = 0; i < gr_local_size; i ++) {
+            s->shm_mon_buffer_key[i] = GR_MON_BUFFER_KEY(gr_app_id, i);
+        }
+        // analytics look the sender up without the semaphore
+        __sync_synchronize();
+        gr_shm_meta->num_senders ++;
+    }
+    sem_post(&gr_shm_meta->sem);
+}
+#endif
+
+static void gr_finalize_shm()
+{
+    if(gr_shm_meta_region) {
+        gr_shm_meta = NULL;
+        df_destroy_shm_region(gr_shm_meta_region);
+        gr_shm_meta_region = NULL;
+    }
+    if(gr_shm_handle) {
+        df_shm_finalize(gr_shm_handle);
+        gr_shm_handle = NULL;
+    }
+}
+
 /*
  * Initialize GoldRush runtime library. 
  * Called by both simulation and analysis.
@@ -124,6 +242,9 @@ int gr_init(MPI_Comm comm)
     gr_local_rank = gr_get_local_rank();
     gr_local_size = gr_get_num_procs_per_node(comm);
 
+    // phase lengths and timing are measured with the calibrated clock
+    gr_clock_init();
+
 #ifdef USE_COOPSCHED
 	coopsched_init();
 	fprintf(stderr, "coop init finished\n");
@@ -147,6 +268,10 @@ int gr_init(MPI_Comm comm)
     }
 #endif
 
+    // without it the analytics are not scheduled and the simulation 
+    // publishes nothing
+    gr_init_shm();
+
     if(!is_simulation) { // analytics, no more work need to be done. 
         return 0;
     }
@@ -171,9 +296,85 @@ int gr_init(MPI_Comm comm)
     }
 
     // threashold value, detemine whether the phase should be used for analysis
+    // phase lengths are in ns, see rdtsc.h
     char *min_phase_str = getenv("GR_MIN_PHASE_LEN");
     if(min_phase_str != NULL) {
-        min_phase_length = atoi(min_phase_str);
+        min_phase_length = strtoull(min_phase_str, NULL, 10);
+    }
+
+    // resume only if this quantile of the phase length distribution exceeds
+    // GR_MIN_PHASE_LEN, e.g. 0.1 means 90% of occurrences are long enough
+    char *resume_quantile_str = getenv("GR_RESUME_QUANTILE");
+    if(resume_quantile_str != NULL) {
+        gr_resume_quantile = atof(resume_quantile_str);
+        if(gr_resume_quantile > 1) {
+            gr_resume_quantile = 1;
+        }
+    }
+
+    // next-phase predictor: merge a short phase with the phases which
+    // usually follow it within GR_PREDICT_MAX_GAP into one idle window
+    char *do_predict_str = getenv("GR_DO_PREDICT");
+    if(do_predict_str != NULL) {
+        gr_do_predict = atoi(do_predict_str);
+    }
+    gr_predict_max_gap = min_phase_length / 10;
+    char *predict_gap_str = getenv("GR_PREDICT_MAX_GAP");
+    if(predict_gap_str != NULL) {
+        gr_predict_max_gap = strtoull(predict_gap_str, NULL, 10);
+    }
+    char *predict_conf_str = getenv("GR_PREDICT_CONFIDENCE");
+    if(predict_conf_str != NULL) {
+        gr_predict_min_confidence = atof(predict_conf_str);
+    }
+    char *predict_depth_str = getenv("GR_PREDICT_DEPTH");
+    if(predict_depth_str != NULL) {
+        gr_predict_depth = atoi(predict_depth_str);
+        if(gr_predict_depth > GR_PREDICT_MAX_DEPTH) {
+            gr_predict_depth = GR_PREDICT_MAX_DEPTH;
+        }
+    }
+
+    // adaptive sampling: stable phases are only fully measured every Nth
+    // occurrence, N adapts between 1 and GR_ADAPTIVE_MAX_STRIDE
+    char *adaptive_str = getenv("GR_ADAPTIVE_SAMPLING");
+    if(adaptive_str != NULL) {
+        gr_adaptive_sampling = atoi(adaptive_str);
+    }
+    char *adaptive_rvar_str = getenv("GR_ADAPTIVE_RVAR");
+    if(adaptive_rvar_str != NULL) {
+        gr_adaptive_rvar = atof(adaptive_rvar_str);
+    }
+    char *adaptive_stride_str = getenv("GR_ADAPTIVE_MAX_STRIDE");
+    if(adaptive_stride_str != NULL) {
+        gr_adaptive_max_stride = atoi(adaptive_stride_str);
+        if(gr_adaptive_max_stride < 1) {
+            gr_adaptive_max_stride = 1;
+        }
+        if(gr_adaptive_max_stride > GR_ADAPTIVE_MAX_STRIDE_LIMIT) {
+            gr_adaptive_max_stride = GR_ADAPTIVE_MAX_STRIDE_LIMIT;
+        }
+    }
+    char *adaptive_min_str = getenv("GR_ADAPTIVE_MIN_SAMPLES");
+    if(adaptive_min_str != NULL) {
+        gr_adaptive_min_samples = atoi(adaptive_min_str);
+    }
+    char *adaptive_drift_str = getenv("GR_ADAPTIVE_DRIFT");
+    if(adaptive_drift_str != NULL) {
+        gr_adaptive_drift = atof(adaptive_drift_str);
+    }
+
+    // warm start the phase table from the profile of a previous run
+    gr_phase_profile = getenv("GR_PHASE_PROFILE");
+    if(gr_phase_profile != NULL) {
+        char *max_age_str = getenv("GR_PHASE_PROFILE_MAX_AGE");
+        if(max_age_str != NULL) {
+            gr_phase_profile_max_age = atoi(max_age_str);
+        }
+        int n = gr_profile_load(gr_phase_profile, gr_comm_rank, gr_phase_profile_max_age);
+        if(n > 0 && gr_comm_rank == 0) {
+            fprintf(stderr, "GoldRush: loaded %d phases from profile %s\n", n, gr_phase_profile);
+        }
     }
 
     // Chao: gr_do_stub is going to monitor the performance of simulation 
@@ -183,6 +384,59 @@ int gr_init(MPI_Comm comm)
     if(gr_do_stub_str != NULL) {
         gr_do_stub = atoi(gr_do_stub_str);
     }
+
+    // measure what the markers themselves cost on this node
+    char *subtract_overhead_str = getenv("GR_SUBTRACT_OVERHEAD");
+    if(subtract_overhead_str != NULL) {
+        gr_subtract_overhead = atoi(subtract_overhead_str);
+    }
+    // back-to-back phases share the counter read at their transition
+    char *snapshot_age_str = getenv("GR_SNAPSHOT_MAX_AGE");
+    if(snapshot_age_str != NULL) {
+        gr_snapshot_max_age = strtoull(snapshot_age_str, NULL, 10);
+    }
+
+#ifdef GR_HAVE_PERFCTR
+    if(gr_shm_handle) {
+        // this rank's samples, phase metrics and predictions
+        gr_mon_buffer_region = gr_create_monitor_buffer(gr_shm_handle, 
+            GR_MON_BUFFER_KEY(gr_app_id, gr_local_rank));
+        if(gr_mon_buffer_region) {
+            gr_monitor_buffer = (gr_mon_buffer_t) gr_mon_buffer_region->starting_addr;
+        }
+
+        // one region per node lets analytics see the load of all ranks at once
+        char *node_threads_str = getenv("GR_NODE_MONITOR_THREADS");
+        if(node_threads_str != NULL && atoi(node_threads_str) > 0) {
+            gr_node_mon_threads = atoi(node_threads_str);
+        }
+        key_t node_key = GR_NODE_MONITOR_KEY_BASE + gr_app_id;
+        if(gr_is_local_leader()) {
+            gr_node_monitor_region = gr_create_node_monitor(gr_shm_handle, node_key,
+                gr_local_size, gr_node_mon_threads);
+        }
+        MPI_Barrier(gr_comm);
+        if(!gr_is_local_leader()) {
+            gr_node_monitor_region = gr_attach_node_monitor(gr_shm_handle, node_key);
+        }
+        if(gr_node_monitor_region) {
+            gr_node_monitor = (gr_node_mon_t) gr_node_monitor_region->starting_addr;
+        }
+
+        // after the regions above, which analytics then find in place
+        gr_register_sender();
+    }
+#endif
+    gr_overhead_calibrate(gr_do_phase_perfctr, gr_do_stub);
+
+    // phases of code without markers are found by sampling
+    char *do_discover_str = getenv("GR_DISCOVER");
+    if(do_discover_str != NULL) {
+        gr_do_discover = atoi(do_discover_str);
+    }
+    if(gr_do_discover && gr_discover_init(gr_comm_rank)) {
+        gr_do_discover = 0;
+    }
 #ifdef DEBUG_TIMING
     my_rank = gr_comm_rank;
     sprintf(log_file_name, "timestamp.%d\0", my_rank);
@@ -203,16 +457,27 @@ int gr_init(MPI_Comm comm)
  */
 int gr_finalize()
 {
-    gr_destroy_global_phases();
-    gr_destroy_opened_files();
-
     if(!is_simulation) { // analytics
+        gr_destroy_global_phases();
+        gr_destroy_interned_names();
         gr_finalize_scheduler();
+        gr_finalize_shm();
         return 0;
     }
 
     // simulation only
 
+    if(gr_do_discover) {
+        gr_discover_finalize();
+    }
+
+    // fold the phase statistics of worker threads into the main thread's
+    gr_merge_phases();
+
+    if(gr_phase_profile != NULL) {
+        gr_profile_save(gr_phase_profile, gr_comm_rank);
+    }
+
 #ifdef GR_HAVE_PERFCTR
     if(gr_do_stub) {
         gr_stub_finalize();
@@ -225,17 +490,27 @@ int gr_finalize()
     fprintf(log_file, "%d\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", 
         my_rank, call_count, total_time, monitor_time, suspend_time, schedule_time, resume_time, stub_time);
     fprintf(log_file, "phase_time:\t%lu\n", phase_time);
+    gr_overhead_print(log_file);
     fprintf(log_file, "\nTiming\n");
     gr_print_phases(log_file);
     fclose(log_file);
 #endif
 
+    gr_destroy_global_phases();
+    gr_destroy_interned_names();
+
 #ifdef GR_HAVE_PERFCTR
-    if(gr_do_stub) {
+    if(gr_mon_buffer_region) {
+        gr_monitor_buffer = NULL;
         gr_destroy_monitor_buffer(gr_mon_buffer_region);
     }
+    if(gr_node_monitor_region) {
+        gr_node_monitor = NULL;
+        gr_destroy_node_monitor(gr_node_monitor_region);
+    }
     gr_perfctr_finalize(gr_comm_rank);
 #endif
+    gr_finalize_shm();
 #ifdef USE_COOPSCHED
         coopsched_deinit();
 #endif
@@ -283,23 +558,27 @@ int gr_mainloop_end()
  */
 int gr_phase_start_s(char *filename, unsigned int line) 
 {
-    /**
-     * here using a hash function to hash the file name
-     * into a unsigned long
-     */
-    //unsigned long int file = hash(filename);
-    
-    int fd = gr_open_file(filename);
-    if (fd == -1) {
-        fprintf(stderr, "failed to get file identifier for (%s), cannot estimate the length.\n", filename);
-    } else {
-        gr_phase_start(fd, line);
-    }
-    
-    return 0;
+    // the interned ID is a hash of the file name, no file is opened
+    return gr_phase_start(gr_intern(filename), line);
 }
 
 
+/*
+ * Publish in the node monitor that a thread entered or left its
+ * outermost phase
+ */
+static inline void gr_node_mark(gr_phase_ctx_t ctx, int in_phase, int phase_id, uint64_t timestamp)
+{
+#ifdef GR_HAVE_PERFCTR
+    if(gr_node_monitor) {
+        int slot = gr_node_slot_index(gr_node_monitor, gr_local_rank, ctx->tid);
+        if(slot != -1) {
+            gr_node_publish_phase(gr_node_monitor, slot, in_phase, phase_id, timestamp);
+        }
+    }
+#endif
+}
+
 /*
  * Mark the start of a phase. 
  *
@@ -312,9 +591,21 @@ int gr_phase_start_s(char *filename, unsigned int line)
 int gr_phase_start(unsigned long int file, unsigned int line)
 {
 #ifdef DEBUG_TIMING
-    t1 = rdtsc();
+    t1 = gr_clock_ns();
 #endif
 
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    if(!ctx) {
+        return -1;
+    }
+
+    // phases may nest: each open phase has its own frame on the stack
+    gr_phase_frame_t f = gr_push_phase_frame(ctx);
+    if(!f) {
+        // nested too deep, this phase is not tracked
+        return 0;
+    }
+
     // estimate the length of the current phase based on history info
     // skip small phases
     gr_phase_perf_t p_perf=NULL;
@@ -323,31 +614,56 @@ int gr_phase_start(unsigned long int file, unsigned int line)
 
 #if PRINT_AVG_LEN
 	if(p_perf && gr_is_main_thread())
-		fprintf(stdout, "**** average phase length ****\n\t %d \n*****************************\n", p_perf->avg_length);
+		fprintf(stdout, "**** average phase length ****\n\t %.0f \n*****************************\n", p_perf->length_stats.mean);
 #endif
 
-	// find a phase with average length larger than minimal requirement
-    if(p && p_perf && p_perf->avg_length != 0 && p_perf->avg_length >= min_phase_length) {
+	// find a phase whose length (mean, or the configured quantile of its
+	// length distribution) is larger than minimal requirement
+    if(p && p->resume_length != 0 && p->resume_length >= min_phase_length) {
         should_run = 1;
     }
-    current_phase_file = file;
-    current_phase_line = line;
 
-#ifdef DEBUG_TIMING
-    t2 = rdtsc();
+    // a short phase may still start a long enough idle window together
+    // with the phases which usually follow it at the same nesting depth
+    f->predicted_idle_length = 0;
+    f->predicted_confidence = 0;
+    if(p && gr_do_predict) {
+        f->predicted_idle_length = gr_predict_idle_window(ctx, ctx->current_phase,
+                                                          &f->predicted_confidence);
+        if(!should_run && f->predicted_idle_length >= min_phase_length &&
+           f->predicted_confidence >= gr_predict_min_confidence) {
+            should_run = 1;
+        }
+    }
+    f->file = file;
+    f->line = line;
+    f->phase_guess = ctx->current_phase;
+    f->is_resumed = 0;
+    f->is_sampled = !gr_adaptive_sampling || gr_phase_is_sampled(p);
+#ifdef GR_HAVE_PERFCTR
+    f->stub_time = gr_stub_time;
 #endif
+    f->child_overhead = 0;
 
-    // resume the analysis process
-    if(should_run && !gr_is_main_thread()) {
-        is_resumed = 1;
-#if USE_COOPSCHED
-        coopsched_yield_cpu_to(0);
+#ifdef DEBUG_TIMING
+    t2 = gr_clock_ns();
 #endif
-		return 0;
-    }
 
-	// worker threads do nothing except to check whether needs to yielding cpu
+	// worker threads only time the phase in their own context, then check 
+	// whether they need to yield the cpu
 	if (!gr_is_main_thread()) {
+        f->start_time = gr_clock_ns_fenced();
+        if(ctx->depth == 1) {
+            gr_node_mark(ctx, 1, f->phase_guess, f->start_time);
+        }
+
+        // resume the analysis process
+        if(should_run) {
+            f->is_resumed = 1;
+#if USE_COOPSCHED
+            coopsched_yield_cpu_to(0);
+#endif
+        }
 		return 0;
 	}
 
@@ -356,30 +672,55 @@ int gr_phase_start(unsigned long int file, unsigned int line)
 	fprintf(stdout, "phase_start: id %d\n", id);
 #endif 
 
+    current_phase_id = f->phase_guess;
+
+    if(!f->is_sampled) {
+        // minimal path of adaptive sampling: timestamp only
+        f->start_time = gr_clock_ns_fenced();
+        if(ctx->depth == 1) {
+            gr_node_mark(ctx, 1, f->phase_guess, f->start_time);
+        }
+        return 0;
+    }
+
+#ifdef GR_HAVE_PERFCTR
+    if(gr_do_predict && gr_monitor_buffer) {
+        gr_publish_prediction(gr_monitor_buffer, current_phase_id, 
+            f->predicted_idle_length, f->predicted_confidence);
+    }
+#endif
+
 #ifdef DEBUG_TIMING
-    t3 = rdtsc();
+    t3 = gr_clock_ns();
 #endif
 
+    f->perfctr_reused = 0;
 #ifdef GR_HAVE_PERFCTR
     if(gr_do_phase_perfctr) {
-        gr_perfctr_read(current_phase_perfctr_values);
+        // the values read when the previous phase ended, if that just happened
+        f->perfctr_reused = (gr_perfctr_snapshot(f->perfctr_values, gr_clock_ns(), 
+                                                 gr_snapshot_max_age) == 1);
     }
 #endif
 
-    current_phase_start_time = rdtsc();
+    f->start_time = gr_clock_ns_fenced();
+    if(ctx->depth == 1) {
+        gr_node_mark(ctx, 1, f->phase_guess, f->start_time);
+    }
 
 #ifdef DEBUG_TIMING
-    t4 = rdtsc();
+    t4 = gr_clock_ns();
 #endif
 
-    if(gr_do_stub) {
-        gr_stub_phase_start(current_phase_perfctr_values);
+    // the stub samples the outermost phase only
+    if(gr_do_stub && ctx->depth == 1) {
+        // sampled in proportion to its usual length
+        gr_stub_phase_start(f->perfctr_values, p ? p->resume_length : 0);
     }
 
 #ifdef DEBUG_TIMING
-    t5 = rdtsc();
+    t5 = gr_clock_ns();
 #endif
-    has_start_phase = 1;
     return 0;        
 }
 
@@ -388,19 +729,64 @@ int gr_phase_start(unsigned long int file, unsigned int line)
  */
 int gr_phase_end_s(char *filename, unsigned int line)
 {
-
 #if USE_COOPSCHED
-    coopsched_init_task(0);
+    // once per thread rather than on every call
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    if(ctx && !ctx->is_coop_task) {
+        coopsched_init_task(0);
+        ctx->is_coop_task = 1;
+    }
 #endif
 
-    int fd = gr_open_file(filename);
-    if (fd == -1) {
-        fprintf(stderr, "failed to get file identifier, cannot estimate the length. \n");
-    } else {
-        gr_phase_end(fd, line);
+    return gr_phase_end(gr_intern(filename), line);
+}
+/*
+ * Work out the instrumentation overhead inside an occurrence of a phase,
+ * and charge the cost of its markers to the enclosing phase. with_perfctr
+ * tells whether counters were read around the phase.
+ *
+ * Return the length with the overhead subtracted.
+ */
+static uint64_t gr_phase_net_length(gr_phase_ctx_t ctx, 
+                                    gr_phase_frame_t f, 
+                                    int depth, 
+                                    uint64_t length, 
+                                    int is_main,
+                                    int with_perfctr,
+                                    uint64_t *overhead
+                                   )
+{
+    // about one clock read falls between the two timestamps, the rest of
+    // the markers outside
+    uint64_t o = gr_overhead_cost.clock_read + f->child_overhead;
+    uint64_t outside = gr_overhead_cost.clock_read;
+    if(with_perfctr) {
+#ifdef GR_HAVE_PERFCTR
+        if(gr_do_phase_perfctr) {
+            outside += (f->perfctr_reused ? 1 : 2) * gr_overhead_cost.perfctr_read;
+        }
+#endif
+        // the stub is armed after the start timestamp
+        if(gr_do_stub && depth == 0) {
+            o += gr_overhead_cost.stub_arm;
+        }
     }
-    return 0;
+    if(depth > 0) {
+        ctx->stack[depth - 1].child_overhead += o + outside;
+    }
+#ifdef GR_HAVE_PERFCTR
+    if(is_main) {
+        // the enclosing phase sees the same handler time itself
+        o += gr_stub_time - f->stub_time;
+    }
+#endif
+    *overhead = o;
+    if(!gr_subtract_overhead) {
+        return length;
+    }
+    return (length > o) ? length - o : 0;
 }
+
 /*
  * Mark the end of a phase. It must match a gr_phase_start() call.
  *
@@ -412,72 +798,158 @@ int gr_phase_end_s(char *filename, unsigned int line)
  */
 int gr_phase_end(unsigned long int file, unsigned int line)
 {
-  if(gr_is_main_thread() && has_start_phase) {
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    if(!ctx || ctx->depth == 0) {
+        return -1;
+    }
+    int depth = ctx->depth - 1; // nesting depth of the phase being ended
+    gr_phase_frame_t f = gr_pop_phase_frame(ctx);
+    if(!f) {
+        // nested too deep, this phase was not tracked
+        return 0;
+    }
+    // the lookup cache works on the guess made when this phase started
+    ctx->current_phase = f->phase_guess;
+
+    if(!f->is_sampled) {
+        // minimal path of adaptive sampling: timestamp only
+        uint64_t end_time = gr_clock_ns_fenced();
+        int p_index = gr_get_phase(f->file, f->line, file, line);
+        if(p_index == -1) {
+            return -1;
+        }
+        uint64_t overhead;
+        uint64_t length = gr_phase_net_length(ctx, f, depth, end_time - f->start_time,
+                                              gr_is_main_thread(), 0, &overhead);
+        gr_update_phase_fast(p_index, length);
+        if(gr_do_predict) {
+            gr_predict_phase_end(ctx, depth, p_index, f->start_time, end_time);
+        }
+        if(depth == 0) {
+            gr_node_mark(ctx, 0, p_index, end_time);
+        }
+        if(depth > 0 && gr_is_main_thread()) {
+            current_phase_id = ctx->stack[depth - 1].phase_guess;
+        }
+        return 0;
+    }
+
+    if(!gr_is_main_thread()) {
+        // worker threads only keep phase lengths, no counters and no stub
+        uint64_t end_time = gr_clock_ns_fenced();
+        f->is_resumed = 0;
+        int p_index = gr_get_phase(f->file, 
+                                   f->line,
+                                   file, 
+                                   line
+                                  );
+        if(p_index == -1) {
+            return -1;
+        }
+        uint64_t overhead;
+        uint64_t length = gr_phase_net_length(ctx, f, depth, end_time - f->start_time,
+                                              0, 0, &overhead);
+        gr_update_phase(p_index, length, NULL);
+        gr_update_phase_overhead(p_index, overhead);
+        if(gr_do_predict) {
+            gr_predict_phase_end(ctx, depth, p_index, f->start_time, end_time);
+        }
+        if(depth == 0) {
+            gr_node_mark(ctx, 0, p_index, end_time);
+        }
+        return 0;
+    }
 
 #ifdef DEBUG_TIMING
-    t6 = rdtsc();
+    t6 = gr_clock_ns();
 #endif
 
-    uint64_t end_cycle = rdtsc();
+    uint64_t end_cycle = gr_clock_ns_fenced();
 
     long long end_perfctr_values[NUM_EVENTS];
 
 #ifdef GR_HAVE_PERFCTR
 // optimize out
     if(gr_do_phase_perfctr) {
-        gr_perfctr_read(end_perfctr_values);
+        gr_perfctr_snapshot(end_perfctr_values, end_cycle, 0);
     }
 #endif
 
 #ifdef DEBUG_TIMING
-    t7 = rdtsc();
+    t7 = gr_clock_ns();
 #endif
 
 // optimize out
-    if(gr_do_stub) {
+    if(gr_do_stub && depth == 0) {
         // disable the timer
         gr_stub_phase_end();
     }
 
 #ifdef DEBUG_TIMING
-    t8 = rdtsc();
+    t8 = gr_clock_ns();
 #endif
 
     // suspend the analysis process
-    if(is_resumed) {
+    if(f->is_resumed) {
         // TODO: lock semaphore
         // Chao: do nothing here first, as it is main thread
-        is_resumed = 0;
+        f->is_resumed = 0;
     }
 
 #ifdef DEBUG_TIMING
-    t9 = rdtsc();
+    t9 = gr_clock_ns();
 #endif
 
     // update phase history
-    int p_index = gr_get_phase(current_phase_file, 
-                               current_phase_line,
+    int p_index = gr_get_phase(f->file, 
+                               f->line,
                                file, 
                                line
                               );
     if(p_index == -1) {
         return -1;
     }
-    uint64_t length = end_cycle - current_phase_start_time;
+    uint64_t overhead;
+    uint64_t length = gr_phase_net_length(ctx, f, depth, end_cycle - f->start_time,
+                                          1, 1, &overhead);
 
 #ifdef GR_HAVE_PERFCTR
 // optimize out
     if(gr_do_phase_perfctr) {
-        int j;
-        for(j = 0; j < NUM_EVENTS; j ++) {
-            end_perfctr_values[j] -= current_phase_perfctr_values[j];
+        int j, num_events = gr_perfctr_num_events();
+        for(j = 0; j < num_events; j ++) {
+            end_perfctr_values[j] -= f->perfctr_values[j];
         }
     }
 #endif
     gr_update_phase(p_index, length, end_perfctr_values);
+    gr_update_phase_overhead(p_index, overhead);
+#ifdef GR_HAVE_PERFCTR
+    if(gr_do_phase_perfctr && gr_monitor_buffer) {
+        gr_publish_phase_metrics(gr_monitor_buffer, p_index, 
+            gr_phase_perf_at(ctx, p_index)->perf_counter.metrics);
+    }
+#endif
+    if(gr_do_predict) {
+        gr_predict_phase_end(ctx, depth, p_index, f->start_time, end_cycle);
+    }
+
+    // back in the enclosing phase, if any
+    if(depth > 0) {
+        current_phase_id = ctx->stack[depth - 1].phase_guess;
+    }
+    else {
+        gr_node_mark(ctx, 0, p_index, end_cycle);
+#ifdef GR_HAVE_PERFCTR
+        if(gr_do_phase_perfctr) {
+            // between outermost phases: the event group may change
+            gr_perfctr_rotate(gr_comm_rank);
+        }
+#endif
+    }
 
 #ifdef DEBUG_TIMING
-    t10 = rdtsc();
+    t10 = gr_clock_ns();
 
     if(is_in_mainloop) {
         phase_time += t6 - t5;
@@ -490,10 +962,7 @@ int gr_phase_end(unsigned long int file, unsigned int line)
         call_count ++;
     }
 #endif
-    has_start_phase = 0;
     return 0;
-  }
-  return -1;
 }
 
 /*
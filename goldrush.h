@@ -95,6 +95,41 @@ int gr_phase_start(unsigned long int file, unsigned int line);
  */
 int gr_phase_end(unsigned long int file, unsigned int line);
 
+/*
+ * Intern a name (e.g. a source file name) and return its stable 64-bit ID,
+ * a hash of the name which can be passed as file to gr_phase_start() and
+ * gr_phase_end().
+ */
+uint64_t gr_intern(const char *name);
+
+/*
+ * Mark the start and end of a phase, with the source file given by name.
+ *
+ * Return 0 for success and -1 for error. 
+ */
+int gr_phase_start_s(char *filename, unsigned int line);
+
+int gr_phase_end_s(char *filename, unsigned int line);
+
+/*
+ * Mark the start and end of a phase at the calling source location. 
+ * __FILE__ is interned once per call site and cached, so these cost the
+ * same as gr_phase_start()/gr_phase_end() with integer IDs.
+ */
+#define GR_PHASE_START() \
+    do { \
+        static uint64_t _gr_file_id = 0; \
+        if(!_gr_file_id) _gr_file_id = gr_intern(__FILE__); \
+        gr_phase_start(_gr_file_id, __LINE__); \
+    } while(0)
+
+#define GR_PHASE_END() \
+    do { \
+        static uint64_t _gr_file_id = 0; \
+        if(!_gr_file_id) _gr_file_id = gr_intern(__FILE__); \
+        gr_phase_end(_gr_file_id, __LINE__); \
+    } while(0)
+
 /*
  * Retrieve a list of registered receivers.
  * 
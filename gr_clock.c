@@ -0,0 +1,89 @@
+/**
+ * Clock source detection and calibration
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rdtsc.h"
+
+#define GR_CLOCK_CALIBRATION_NS 10000000ULL // 10 ms
+
+gr_clock gr_clock_info = {GR_CLOCK_MONOTONIC_RAW, 0, 0, 0};
+
+#ifdef GR_HAVE_TSC
+#include <cpuid.h>
+
+/*
+ * Test if the TSC is invariant (CPUID.80000007H:EDX[8])
+ */
+static int gr_tsc_is_invariant()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return 0;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
+
+/*
+ * Measure TSC ticks against CLOCK_MONOTONIC_RAW. Each end point is the
+ * TSC read closest to a clock_gettime() call, taken from the read pair
+ * with the shortest gap.
+ */
+static void gr_tsc_sample(uint64_t *tsc, uint64_t *ns)
+{
+    uint64_t best = UINT64_MAX;
+    int i;
+    for(i = 0; i < 5; i ++) {
+        uint64_t t0 = rdtsc_fenced();
+        uint64_t n = gr_clock_raw_ns();
+        uint64_t t1 = rdtsc_fenced();
+        if(t1 - t0 < best) {
+            best = t1 - t0;
+            *tsc = t0 + (t1 - t0) / 2;
+            *ns = n;
+        }
+    }
+}
+
+static int gr_tsc_calibrate()
+{
+    uint64_t tsc0, ns0, tsc1, ns1;
+    gr_tsc_sample(&tsc0, &ns0);
+    while(gr_clock_raw_ns() - ns0 < GR_CLOCK_CALIBRATION_NS) ;
+    gr_tsc_sample(&tsc1, &ns1);
+    if(tsc1 <= tsc0 || ns1 <= ns0) {
+        return -1;
+    }
+    gr_clock_info.mult = (uint64_t) (((unsigned __int128) (ns1 - ns0) << GR_CLOCK_SHIFT) / (tsc1 - tsc0));
+    gr_clock_info.tsc_base = tsc1;
+    gr_clock_info.ns_base = ns1;
+    return 0;
+}
+#endif
+
+int gr_clock_init()
+{
+    gr_clock_info.source = GR_CLOCK_MONOTONIC_RAW;
+    char *clock_str = getenv("GR_CLOCK");
+    if(clock_str != NULL && !strcmp(clock_str, "monotonic")) {
+        return 0;
+    }
+#ifdef GR_HAVE_TSC
+    if(!gr_tsc_is_invariant()) {
+        return 0;
+    }
+    if(gr_tsc_calibrate()) {
+        fprintf(stderr, "Error: cannot calibrate TSC, using CLOCK_MONOTONIC_RAW. %s:%d\n",
+            __FILE__, __LINE__);
+        return -1;
+    }
+    gr_clock_info.source = GR_CLOCK_TSC;
+#endif
+    return 0;
+}
+
@@ -0,0 +1,400 @@
+/**
+ * Automatic phase discovery by instruction pointer sampling
+ *
+ */
+#ifdef __linux__
+
+#define _GNU_SOURCE // dladdr()
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "goldrush.h"
+#include "rdtsc.h"
+#include "gr_phase.h"
+#include "gr_predict.h"
+#include "gr_discover.h"
+#ifdef GR_HAVE_PERFCTR
+#include "gr_monitor_buffer.h"
+#include "gr_node_monitor.h"
+#endif
+
+/*
+ * The run of samples being followed
+ */
+typedef struct _gr_discover_run {
+    uint64_t region; // ip >> region bits
+    uint64_t first_ip;
+    uint64_t start_time; // of the first sample in the region
+    uint64_t last_time; // of the last sample in the region
+    int num_samples; // 0 if there is no run
+    int num_stray; // samples elsewhere since the last one in the region
+    int p_index; // -1 until the run is long enough to be a phase
+} gr_discover_run, *gr_discover_run_t;
+
+typedef struct _gr_discover_region {
+    uint64_t region;
+    int p_index;
+} gr_discover_region;
+
+/* Tunable parameters */
+static uint64_t discover_period_ns = GR_DISCOVER_DEFAULT_PERIOD * 1000;
+static int discover_region_bits = GR_DISCOVER_DEFAULT_REGION_BITS;
+static int discover_min_samples = GR_DISCOVER_DEFAULT_MIN_SAMPLES;
+static int discover_tolerance = GR_DISCOVER_DEFAULT_TOLERANCE;
+
+static int gr_discover_fd = -1;
+static struct perf_event_mmap_page *gr_discover_ring = NULL;
+static size_t gr_discover_ring_size = 0; // data pages only
+static long gr_discover_page_size = 0;
+static pthread_t gr_discover_thread;
+static volatile int gr_discover_stop = 0;
+
+// the discovery thread's phase table; its first gr_discover_num_shared
+// phases were copied from the main thread's, -1 if the copy failed
+static gr_phase_ctx_t gr_discover_ctx = NULL;
+static int gr_discover_num_shared = 0;
+static sem_t gr_discover_ready;
+
+// only the discovery thread touches these
+static gr_discover_run gr_run;
+static gr_discover_region gr_regions[GR_DISCOVER_CACHE_SIZE];
+
+extern int current_phase_id;
+extern int gr_do_predict;
+#ifdef GR_HAVE_PERFCTR
+extern gr_mon_buffer_t gr_monitor_buffer;
+extern gr_node_mon_t gr_node_monitor;
+extern int gr_local_rank;
+#endif
+
+/*
+ * Phase of the region holding ip, found or allocated in the calling
+ * thread's phase table. Return -1 for error.
+ */
+static int gr_discover_phase(uint64_t ip)
+{
+    uint64_t region = ip >> discover_region_bits;
+    gr_discover_region *c = &gr_regions[(region * 0x9e3779b97f4a7c15ULL >> 32) & (GR_DISCOVER_CACHE_SIZE - 1)];
+    if(c->p_index != -1 && c->region == region) {
+        return c->p_index;
+    }
+
+    // named after the binary or library and the region's offset in it
+    unsigned long int file;
+    unsigned int line;
+    Dl_info info;
+    if(dladdr((void *) ip, &info) && info.dli_fname) {
+        file = gr_intern(info.dli_fname);
+        line = (unsigned int) ((ip - (uint64_t) info.dli_fbase) >> discover_region_bits);
+    }
+    else {
+        // e.g. JIT code: the address is all we have
+        file = gr_intern("[anonymous]");
+        line = (unsigned int) region;
+    }
+    int p_index = gr_get_phase(file, line, file, line);
+    if(p_index != -1) {
+        c->region = region;
+        c->p_index = p_index;
+    }
+    return p_index;
+}
+
+/*
+ * ID under which phase p_index of the discovery thread's table is published
+ */
+static inline int gr_discover_phase_id(int p_index)
+{
+    return (p_index < gr_discover_num_shared) ? p_index : GR_DISCOVER_PHASE_ID_BASE + p_index;
+}
+
+/*
+ * Publish that the main thread is in, or has left, a discovered phase
+ */
+static void gr_discover_mark(int in_phase, int p_index, uint64_t timestamp)
+{
+#ifdef GR_HAVE_PERFCTR
+    if(gr_node_monitor) {
+        int slot = gr_node_slot_index(gr_node_monitor, gr_local_rank, 0);
+        if(slot != -1) {
+            gr_node_publish_phase(gr_node_monitor, slot, in_phase, 
+                gr_discover_phase_id(p_index), timestamp);
+        }
+    }
+#endif
+}
+
+/*
+ * The run has become long enough: it is an occurrence of its region's phase
+ */
+static void gr_discover_confirm(gr_phase_ctx_t ctx, gr_discover_run_t r)
+{
+    r->p_index = gr_discover_phase(r->first_ip);
+    if(r->p_index == -1) {
+        return;
+    }
+    current_phase_id = gr_discover_phase_id(r->p_index);
+    gr_discover_mark(1, r->p_index, r->start_time);
+#ifdef GR_HAVE_PERFCTR
+    if(gr_do_predict && gr_monitor_buffer) {
+        // the phase was found late, only the rest of its window is left
+        double confidence;
+        uint64_t window = gr_predict_idle_window(ctx, r->p_index, &confidence);
+        uint64_t elapsed = r->last_time - r->start_time;
+        gr_publish_prediction(gr_monitor_buffer, gr_discover_phase_id(r->p_index),
+            (window > elapsed) ? window - elapsed : 0, confidence);
+    }
+#endif
+}
+
+static void gr_discover_end_run(gr_phase_ctx_t ctx, gr_discover_run_t r)
+{
+    if(r->num_samples > 0 && r->p_index != -1) {
+        // the last sample stands for the period before it
+        uint64_t end_time = r->last_time + discover_period_ns;
+        gr_update_phase(r->p_index, end_time - r->start_time, NULL);
+        if(gr_do_predict) {
+            gr_predict_phase_end(ctx, 0, r->p_index, r->start_time, end_time);
+        }
+        gr_discover_mark(0, r->p_index, end_time);
+    }
+    r->num_samples = 0;
+}
+
+static void gr_discover_sample(gr_phase_ctx_t ctx, uint64_t ip, uint64_t time)
+{
+    gr_discover_run_t r = &gr_run;
+    uint64_t region = ip >> discover_region_bits;
+
+    // without samples for a while the thread was not running: the run ended
+    if(r->num_samples > 0 &&
+       time - r->last_time > (uint64_t) (discover_tolerance + 2) * discover_period_ns) {
+        gr_discover_end_run(ctx, r);
+    }
+    if(r->num_samples > 0 && region == r->region) {
+        r->num_samples ++;
+        r->last_time = time;
+        r->num_stray = 0;
+        if(r->p_index == -1 && r->num_samples >= discover_min_samples) {
+            gr_discover_confirm(ctx, r);
+        }
+        return;
+    }
+    if(r->num_samples > 0 && ++ r->num_stray <= discover_tolerance) {
+        // e.g. a short call out of the region
+        return;
+    }
+
+    gr_discover_end_run(ctx, r);
+    r->region = region;
+    r->first_ip = ip;
+    r->start_time = time;
+    r->last_time = time;
+    r->num_samples = 1;
+    r->num_stray = 0;
+    r->p_index = -1;
+    if(discover_min_samples <= 1) {
+        gr_discover_confirm(ctx, r);
+    }
+}
+
+/*
+ * Copy len bytes at offset of the ring's data area, which may wrap
+ */
+static void gr_discover_copy(void *dst, uint64_t offset, size_t len)
+{
+    char *data = (char *) gr_discover_ring + gr_discover_page_size;
+    size_t o = offset & (gr_discover_ring_size - 1);
+    size_t n = (o + len <= gr_discover_ring_size) ? len : gr_discover_ring_size - o;
+    memcpy(dst, data + o, n);
+    if(n < len) {
+        memcpy((char *) dst + n, data, len - n);
+    }
+}
+
+/*
+ * Process the samples in the ring
+ */
+static void gr_discover_drain(gr_phase_ctx_t ctx)
+{
+    uint64_t head = __atomic_load_n(&gr_discover_ring->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = gr_discover_ring->data_tail;
+    while(tail < head) {
+        struct perf_event_header header;
+        gr_discover_copy(&header, tail, sizeof(header));
+        if(header.type == PERF_RECORD_SAMPLE) {
+            // PERF_SAMPLE_IP | PERF_SAMPLE_TIME
+            uint64_t body[2];
+            gr_discover_copy(body, tail + sizeof(header), sizeof(body));
+            gr_discover_sample(ctx, body[0], body[1]);
+        }
+        // lost records only leave a gap in time
+        tail += header.size;
+    }
+    __atomic_store_n(&gr_discover_ring->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void *gr_discover_thread_func(void *arg)
+{
+    // discovered phases go to this thread's own phase table, in the main
+    // thread's index space; gr_discover_init() waits for the copy
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    gr_discover_num_shared = ctx ? gr_copy_main_phases() : -1;
+    gr_discover_ctx = ctx;
+    sem_post(&gr_discover_ready);
+    if(gr_discover_num_shared == -1) {
+        return NULL;
+    }
+    struct pollfd pfd;
+    pfd.fd = gr_discover_fd;
+    pfd.events = POLLIN;
+    while(!gr_discover_stop) {
+        // the ring wakes us up every GR_DISCOVER_WAKEUP samples
+        int timeout_ms = (int) (GR_DISCOVER_WAKEUP * discover_period_ns / 1000000) + 1;
+        if(poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR) {
+            fprintf(stderr, "Error: poll() on sampling event: %s. %s:%d\n",
+                strerror(errno), __FILE__, __LINE__);
+            break;
+        }
+        gr_discover_drain(ctx);
+        // no samples while the main thread is blocked
+        uint64_t now = gr_clock_ns();
+        if(gr_run.num_samples > 0 && now > gr_run.last_time && now - gr_run.last_time >
+           (uint64_t) (discover_tolerance + 2) * discover_period_ns) {
+            gr_discover_end_run(ctx, &gr_run);
+        }
+    }
+    return NULL;
+}
+
+int gr_discover_init(int mpi_rank)
+{
+    char *temp_str = getenv("GR_DISCOVER_PERIOD");
+    if(temp_str && atoi(temp_str) > 0) {
+        discover_period_ns = strtoull(temp_str, NULL, 10) * 1000;
+    }
+    temp_str = getenv("GR_DISCOVER_REGION_BITS");
+    if(temp_str) {
+        discover_region_bits = atoi(temp_str);
+    }
+    temp_str = getenv("GR_DISCOVER_MIN_SAMPLES");
+    if(temp_str) {
+        discover_min_samples = atoi(temp_str);
+    }
+    temp_str = getenv("GR_DISCOVER_TOLERANCE");
+    if(temp_str) {
+        discover_tolerance = atoi(temp_str);
+    }
+    int i;
+    for(i = 0; i < GR_DISCOVER_CACHE_SIZE; i ++) {
+        gr_regions[i].p_index = -1;
+    }
+    gr_run.num_samples = 0;
+
+    // sample the calling thread every period of its CPU time, with
+    // timestamps on the clock gr_clock_ns() follows
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = discover_period_ns;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TIME;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.wakeup_events = GR_DISCOVER_WAKEUP;
+    attr.use_clockid = 1;
+    attr.clockid = CLOCK_MONOTONIC_RAW;
+    gr_discover_fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if(gr_discover_fd == -1) {
+        fprintf(stderr, "Error: rank %d cannot sample the instruction pointer: %s. %s:%d\n",
+            mpi_rank, strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+
+    gr_discover_page_size = sysconf(_SC_PAGESIZE);
+    gr_discover_ring_size = GR_DISCOVER_RING_PAGES * gr_discover_page_size;
+    void *ring = mmap(NULL, gr_discover_page_size + gr_discover_ring_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, gr_discover_fd, 0);
+    if(ring == MAP_FAILED) {
+        fprintf(stderr, "Error: rank %d cannot map the sample ring: %s. %s:%d\n",
+            mpi_rank, strerror(errno), __FILE__, __LINE__);
+        close(gr_discover_fd);
+        gr_discover_fd = -1;
+        return -1;
+    }
+    gr_discover_ring = (struct perf_event_mmap_page *) ring;
+
+    gr_discover_stop = 0;
+    sem_init(&gr_discover_ready, 0, 0);
+    int rc = pthread_create(&gr_discover_thread, NULL, gr_discover_thread_func, NULL);
+    if(rc) {
+        fprintf(stderr, "Error: pthread_create() returns %d. %s:%d\n",
+            rc, __FILE__, __LINE__);
+    }
+    else {
+        while(sem_wait(&gr_discover_ready) == -1 && errno == EINTR);
+        if(gr_discover_num_shared == -1) {
+            fprintf(stderr, "Error: rank %d cannot set up the discovery phase table. %s:%d\n",
+                mpi_rank, __FILE__, __LINE__);
+            pthread_join(gr_discover_thread, NULL);
+            rc = -1;
+        }
+    }
+    sem_destroy(&gr_discover_ready);
+    if(rc) {
+        munmap(gr_discover_ring, gr_discover_page_size + gr_discover_ring_size);
+        close(gr_discover_fd);
+        gr_discover_ring = NULL;
+        gr_discover_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int gr_discover_finalize()
+{
+    if(gr_discover_fd == -1) {
+        return 0;
+    }
+    gr_discover_stop = 1;
+    pthread_join(gr_discover_thread, NULL);
+    gr_return_main_phases(gr_discover_ctx, gr_discover_num_shared);
+    ioctl(gr_discover_fd, PERF_EVENT_IOC_DISABLE, 0);
+    munmap(gr_discover_ring, gr_discover_page_size + gr_discover_ring_size);
+    close(gr_discover_fd);
+    gr_discover_ring = NULL;
+    gr_discover_fd = -1;
+    return 0;
+}
+
+#else
+
+#include <stdio.h>
+#include "gr_discover.h"
+
+int gr_discover_init(int mpi_rank)
+{
+    fprintf(stderr, "Error: phase discovery needs perf_event_open(). %s:%d\n",
+        __FILE__, __LINE__);
+    return -1;
+}
+
+int gr_discover_finalize()
+{
+    return 0;
+}
+
+#endif
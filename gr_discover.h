@@ -0,0 +1,51 @@
+#ifndef _GR_DISCOVER_H_
+#define _GR_DISCOVER_H_
+/**
+ * Automatic phase discovery
+ *
+ * For codes without phase markers. The main thread's instruction pointer
+ * is sampled with perf_event_open() every GR_DISCOVER_PERIOD us of its CPU
+ * time, and a discovery thread reads the samples. Code is cut into aligned
+ * regions of 2^GR_DISCOVER_REGION_BITS bytes; a run of at least
+ * GR_DISCOVER_MIN_SAMPLES samples in one region, allowing
+ * GR_DISCOVER_TOLERANCE samples elsewhere in between, is an occurrence of
+ * the phase of that region.
+ *
+ * A discovered phase starts and ends at (file, line) = (ID of the binary or
+ * library, offset of the region in it), so it is the same in every run and
+ * can be kept in phase profiles. Phases are recorded in the discovery
+ * thread's phase table, which starts as a copy of the main thread's, with
+ * the phase profile loaded: phases known at init keep their history and
+ * main thread index, and go back to the main thread's table at finalize.
+ * Phases first found in this run are merged like those of worker threads,
+ * and published as GR_DISCOVER_PHASE_ID_BASE + their index, apart from the
+ * main thread's. Their predicted idle windows are published in the monitor
+ * buffer.
+ */
+#include <stdint.h>
+
+#define GR_DISCOVER_DEFAULT_PERIOD 100 // us of CPU time
+#define GR_DISCOVER_DEFAULT_REGION_BITS 12
+#define GR_DISCOVER_DEFAULT_MIN_SAMPLES 4
+#define GR_DISCOVER_DEFAULT_TOLERANCE 1
+#define GR_DISCOVER_WAKEUP 8 // samples read at once
+#define GR_DISCOVER_RING_PAGES 16 // a power of 2
+#define GR_DISCOVER_CACHE_SIZE 256 // regions whose phase is remembered, a power of 2
+#define GR_DISCOVER_PHASE_ID_BASE (1 << 24)
+
+/*
+ * Start sampling the calling thread, which must be the main thread, and
+ * the discovery thread. Call after the phase profile is loaded.
+ *
+ * Return 0 for success and -1 for error.
+ */
+int gr_discover_init(int mpi_rank);
+
+/*
+ * Stop the discovery thread and hand the phases it shares with the main
+ * thread back. The phase it is in is not recorded. Call before the phase
+ * tables are merged.
+ */
+int gr_discover_finalize();
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * String interning registry
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "goldrush.h"
+#include "gr_intern.h"
+
+typedef struct _gr_interned_name {
+    uint64_t id;    // 0 for an empty slot
+    char *name;
+} gr_interned_name, *gr_interned_name_t;
+
+// fixed size open-addressing table: slots are only ever filled, so readers
+// need no lock. Writers are serialized by gr_intern_lock.
+static gr_interned_name gr_interned_names[GR_MAX_INTERNED_NAMES];
+static int gr_num_interned_names = 0;
+static pthread_mutex_t gr_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * 64-bit FNV-1a
+ */
+uint64_t gr_hash_name(const char *name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *c = (const unsigned char *) name;
+    while(*c) {
+        h ^= *c ++;
+        h *= 0x100000001b3ULL;
+    }
+    // 0 marks an empty slot, keep it out of the ID space
+    return h ? h : 1;
+}
+
+static gr_interned_name_t gr_intern_slot(uint64_t id)
+{
+    int mask = GR_MAX_INTERNED_NAMES - 1;
+    int s = (int) (id & mask);
+    int i;
+    for(i = 0; i < GR_MAX_INTERNED_NAMES; i ++) {
+        uint64_t slot_id = __atomic_load_n(&gr_interned_names[s].id, __ATOMIC_ACQUIRE);
+        if(slot_id == id || slot_id == 0) {
+            return &gr_interned_names[s];
+        }
+        s = (s + 1) & mask;
+    }
+    return NULL;
+}
+
+/*
+ * Intern a name and return its ID
+ */
+uint64_t gr_intern(const char *name)
+{
+    uint64_t id = gr_hash_name(name);
+    gr_interned_name_t slot = gr_intern_slot(id);
+    if(slot && slot->id == id) {
+        return id;
+    }
+
+    pthread_mutex_lock(&gr_intern_lock);
+    slot = gr_intern_slot(id);
+    if(slot && slot->id == 0 && gr_num_interned_names < GR_MAX_INTERNED_NAMES - 1) {
+        slot->name = strdup(name);
+        // publish the name before the ID which marks the slot as used
+        __atomic_store_n(&slot->id, id, __ATOMIC_RELEASE);
+        gr_num_interned_names ++;
+    }
+    pthread_mutex_unlock(&gr_intern_lock);
+
+    // the ID is usable even if the registry is full, only its name is lost
+    return id;
+}
+
+const char *gr_intern_lookup(uint64_t id)
+{
+    gr_interned_name_t slot = gr_intern_slot(id);
+    if(slot && slot->id == id) {
+        return slot->name;
+    }
+    return NULL;
+}
+
+void gr_destroy_interned_names()
+{
+    int i;
+    pthread_mutex_lock(&gr_intern_lock);
+    for(i = 0; i < GR_MAX_INTERNED_NAMES; i ++) {
+        if(gr_interned_names[i].id) {
+            free(gr_interned_names[i].name);
+            gr_interned_names[i].name = NULL;
+            gr_interned_names[i].id = 0;
+        }
+    }
+    gr_num_interned_names = 0;
+    pthread_mutex_unlock(&gr_intern_lock);
+}
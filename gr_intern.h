@@ -0,0 +1,30 @@
+#ifndef _GR_INTERN_H_
+#define _GR_INTERN_H_
+/**
+ * String interning registry
+ *
+ * Maps a name (typically a source file name) to a stable 64-bit ID which 
+ * can be used wherever an integer file identifier is expected. The ID is a 
+ * hash of the name, so it is the same in every process and every run. The
+ * registry only remembers names to print them back.
+ */
+#include <stdint.h>
+
+#define GR_MAX_INTERNED_NAMES 1024
+
+/*
+ * Hash a name into its ID without registering it
+ */
+uint64_t gr_hash_name(const char *name);
+
+/*
+ * Get the name registered for an ID, or NULL if unknown
+ */
+const char *gr_intern_lookup(uint64_t id);
+
+/*
+ * Release registered names
+ */
+void gr_destroy_interned_names();
+
+#endif
@@ -14,6 +14,10 @@
 #define GR_MAX_NUM_PROCS 32
 #define PAGE_SIZE 4096
 
+// shm key of the monitor buffer of a local rank of an application
+#define GR_MON_BUFFER_KEY(app_id, local_rank) \
+    (SHM_MONITOR_BUFFER_KEY_BASE + (app_id) * GR_MAX_NUM_PROCS + (local_rank))
+
 typedef struct _gr_data_dep {
     char data_group_name[30];
     int sender_app_id;
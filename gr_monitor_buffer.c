@@ -1,18 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
-#include <pthread.h>
 #include "df_shm.h"
 #include "gr_perfctr.h"
 #include "gr_monitor_buffer.h"
 
 df_shm_region_t gr_create_monitor_buffer(df_shm_method_t shm_handle, key_t shm_key)
 {
+    uint32_t ring_depth = GR_MON_RING_DEFAULT_DEPTH;
+    char *depth_str = getenv("GR_MON_RING_DEPTH");
+    if(depth_str) {
+        int d = atoi(depth_str);
+        ring_depth = 1;
+        while((int) ring_depth < d && ring_depth < GR_MON_RING_MAX_DEPTH) {
+            ring_depth <<= 1;
+        }
+    }
+    size_t region_size = sizeof(gr_mon_buffer) + ring_depth * sizeof(gr_mon_slot);
+    if(region_size < SHM_MONITOR_BUFFER_SIZE) {
+        region_size = SHM_MONITOR_BUFFER_SIZE;
+    }
+
     // create a shared memory region
     void *shm_region_name = (void *) &shm_key;
     int shm_region_name_size = sizeof(shm_key);     
     df_shm_region_t buffer_region = df_create_named_shm_region(shm_handle,
-        shm_region_name, shm_region_name_size, SHM_MONITOR_BUFFER_SIZE, NULL);
+        shm_region_name, shm_region_name_size, region_size, NULL);
     if(!buffer_region) {
         fprintf(stderr, "Error: Cannot create shared memory for monitor buffer. %s:%d\n",
             __FILE__, __LINE__);
@@ -20,38 +36,32 @@ df_shm_region_t gr_create_monitor_buffer(df_shm_method_t shm_handle, key_t shm_k
     }
     gr_mon_buffer_t mon_buffer = (gr_mon_buffer_t) buffer_region->starting_addr;
 
-    // set up a read-write lock in shared memory
-    pthread_rwlockattr_t rwlattr;
-    if(pthread_rwlockattr_init(&rwlattr)) {
-        fprintf(stderr, "Error: pthread_rwlockattr_init() returns %d. %s:%d\n",
-            __FILE__, __LINE__);
-        return NULL;
-    }
-    if(pthread_rwlockattr_setpshared(&rwlattr, PTHREAD_PROCESS_SHARED)) {
-        fprintf(stderr, "Error: pthread_rwlockattr_setpshared() returns %d. %s:%d\n",
-            __FILE__, __LINE__);
-        return NULL;
+    // set up a monitor buffer in shared memory
+    int r;
+    mon_buffer->ring_depth = ring_depth;
+    mon_buffer->num_events = gr_perfctr_num_events();
+    for(r = 0; r < GR_NUM_ROLES; r ++) {
+        mon_buffer->roles[r] = (int8_t) gr_perfctr_role_index(r);
     }
-    if(pthread_rwlock_init(&(mon_buffer->rwlock), &rwlattr)) {
-        fprintf(stderr, "Error: pthread_rwlock_init() returns %d. %s:%d\n",
-            __FILE__, __LINE__);
-        return NULL;
+    mon_buffer->sample_head = 0;
+    memset(mon_buffer->ring, 0, ring_depth * sizeof(gr_mon_slot));
+    mon_buffer->metrics_seq = 0;
+    mon_buffer->metrics_phase_id = -1;
+    for(r = 0; r < GR_NUM_METRICS; r ++) {
+        mon_buffer->phase_metrics[r] = -1;
     }
-    // pthread_rwlockattr_destroy(&rwlattr);
-  
-    // set up a monitor buffer in shared memory
-    memset(mon_buffer->perfctr_values, 0, sizeof(long long)*NUM_EVENTS);
+    mon_buffer->prediction_seq = 0;
+    mon_buffer->predicted_phase_id = -1;
+    mon_buffer->predicted_idle_length = 0;
+    mon_buffer->predicted_confidence = 0;
+
+    // readers map the region once its size is set
+    __atomic_store_n(&mon_buffer->region_size, (uint64_t) region_size, __ATOMIC_RELEASE);
     return buffer_region;
 }
 
 int gr_destroy_monitor_buffer(df_shm_region_t region)
 {
-    gr_mon_buffer_t mon_buffer = (gr_mon_buffer_t) region->starting_addr;
-
-    // release the lock
-    // TODO: use reference count on monitor buffer
-    //pthread_rwlock_destroy(&(mon_buffer->rwlock));
-
     // detach the shared memory buffer
     df_destroy_shm_region(region);
     return 0;
@@ -62,21 +72,141 @@ df_shm_region_t gr_attach_monitor_buffer(df_shm_method_t shm_handle, key_t shm_k
     df_shm_region_t mon_buffer_region = NULL;   
     void *shm_region_name = (void *) &shm_key;
     int shm_region_name_size = sizeof(shm_key);
+    size_t region_size = SHM_MONITOR_BUFFER_SIZE;
 
     while(1) {
         // attach to the shared memory region
         mon_buffer_region = df_attach_named_shm_region(shm_handle, shm_region_name,
-            shm_region_name_size, SHM_MONITOR_BUFFER_SIZE, NULL);
+            shm_region_name_size, region_size, NULL);
         if(!mon_buffer_region) {
             // wait until the shm region is created
             sleep(1);
             fprintf(stderr, "Error: Cannot attach shm region. %s:%d\n",
                 __FILE__, __LINE__);
+            continue;
         }
-        else {
+        gr_mon_buffer_t mon_buffer = (gr_mon_buffer_t) mon_buffer_region->starting_addr;
+        uint64_t size = __atomic_load_n(&mon_buffer->region_size, __ATOMIC_ACQUIRE);
+        if(size == region_size) {
             break;
         }
+        // not set up yet, or the ring does not fit in what is mapped
+        df_destroy_shm_region(mon_buffer_region);
+        if(size == 0) {
+            sleep(1);
+        }
+        else {
+            region_size = size;
+        }
     }
     return mon_buffer_region;
 }
 
+int gr_mon_buffer_role_index(gr_mon_buffer_t mon_buffer, const char *role_name)
+{
+    int role = gr_perfctr_role_by_name(role_name);
+    if(role == -1) {
+        return -1;
+    }
+    return mon_buffer->roles[role];
+}
+
+void gr_publish_sample(gr_mon_buffer_t mon_buffer, 
+                       int phase_id, 
+                       uint64_t timestamp, 
+                       uint64_t interval,
+                       long long *perfctr_values, 
+                       double *metrics
+                      )
+{
+    // the stub is the only writer of the ring
+    uint64_t n = mon_buffer->sample_head;
+    gr_mon_slot_t slot = &mon_buffer->ring[n & (mon_buffer->ring_depth - 1)];
+    gr_mon_sample_t sample = &slot->sample;
+    uint32_t s = gr_seq_write_begin(&slot->seq);
+    sample->sample_count = n + 1;
+    sample->timestamp = timestamp;
+    sample->interval = interval;
+    sample->phase_id = phase_id;
+    memcpy(sample->perfctr_values, perfctr_values, sizeof(long long)*mon_buffer->num_events);
+    memcpy(sample->metrics, metrics, sizeof(double)*GR_NUM_METRICS);
+    gr_seq_write_end(&slot->seq, s);
+    __atomic_store_n(&mon_buffer->sample_head, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy sample n (counting from 0). Return -1 if it has been overwritten.
+ */
+static int gr_read_slot(gr_mon_buffer_t mon_buffer, uint64_t n, gr_mon_sample_t sample)
+{
+    gr_mon_slot_t slot = &mon_buffer->ring[n & (mon_buffer->ring_depth - 1)];
+    uint32_t s;
+    do {
+        s = gr_seq_read_begin(&slot->seq);
+        memcpy(sample, &slot->sample, sizeof(gr_mon_sample));
+    } while(gr_seq_read_retry(&slot->seq, s));
+    return (sample->sample_count == n + 1) ? 0 : -1;
+}
+
+int gr_read_samples(gr_mon_buffer_t mon_buffer, 
+                    uint64_t *next_sample, 
+                    gr_mon_sample_t samples, 
+                    int max_samples
+                   )
+{
+    uint64_t head = __atomic_load_n(&mon_buffer->sample_head, __ATOMIC_ACQUIRE);
+    uint64_t n = *next_sample;
+    int num_read = 0;
+    while(n < head && num_read < max_samples) {
+        if(head - n > mon_buffer->ring_depth) {
+            // overwritten before we got here
+            n = head - mon_buffer->ring_depth;
+        }
+        if(gr_read_slot(mon_buffer, n, &samples[num_read])) {
+            // overwritten while we read, move on to what is left
+            head = __atomic_load_n(&mon_buffer->sample_head, __ATOMIC_ACQUIRE);
+            n ++;
+            continue;
+        }
+        num_read ++;
+        n ++;
+    }
+    *next_sample = n;
+    return num_read;
+}
+
+int gr_read_sample(gr_mon_buffer_t mon_buffer, gr_mon_sample_t sample)
+{
+    while(1) {
+        uint64_t head = __atomic_load_n(&mon_buffer->sample_head, __ATOMIC_ACQUIRE);
+        if(head == 0) {
+            return -1;
+        }
+        if(!gr_read_slot(mon_buffer, head - 1, sample)) {
+            return 0;
+        }
+    }
+}
+
+int gr_publish_prediction(gr_mon_buffer_t mon_buffer, 
+                          int phase_id, 
+                          uint64_t idle_length, 
+                          double confidence
+                         )
+{
+    uint32_t s = gr_seq_write_begin(&mon_buffer->prediction_seq);
+    mon_buffer->predicted_phase_id = phase_id;
+    mon_buffer->predicted_idle_length = idle_length;
+    mon_buffer->predicted_confidence = confidence;
+    gr_seq_write_end(&mon_buffer->prediction_seq, s);
+    return 0;
+}
+
+int gr_publish_phase_metrics(gr_mon_buffer_t mon_buffer, int phase_id, double *metrics)
+{
+    uint32_t s = gr_seq_write_begin(&mon_buffer->metrics_seq);
+    mon_buffer->metrics_phase_id = phase_id;
+    memcpy(mon_buffer->phase_metrics, metrics, sizeof(double)*GR_NUM_METRICS);
+    gr_seq_write_end(&mon_buffer->metrics_seq, s);
+    return 0;
+}
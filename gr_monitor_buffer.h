@@ -2,24 +2,182 @@
 #define _GR_MONITOR_BUFFER_H_
 #include <sys/ipc.h>
 #include <sys/shm.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <sched.h>
 #include "gr_perfctr.h"
 #include "df_shm.h"
 
 #define SHM_MONITOR_BUFFER_KEY_BASE 1800
-#define SHM_MONITOR_BUFFER_SIZE 4096
+#define SHM_MONITOR_BUFFER_SIZE 4096 // mapped first, to read the size of the region
+#define GR_MON_RING_DEFAULT_DEPTH 64
+#define GR_MON_RING_MAX_DEPTH 65536
 
-// Global variables
-typedef struct _gr_monitor_buffer {
-    pthread_rwlock_t rwlock;
+/*
+ * Each section of the monitor buffer has a single writer in the simulation
+ * and is guarded by a sequence count, odd while the writer is updating it.
+ * Writers never wait. Readers copy a section and retry if its count was
+ * odd or changed meanwhile. Sections are on separate cache lines.
+ *
+ * The stub's samples go to a ring of GR_MON_RING_DEPTH slots at the end of
+ * the region, each slot a section of its own. sample_head counts the
+ * samples written so far; sample n is in slot n % ring_depth until it is
+ * overwritten ring_depth samples later.
+ */
+#define GR_MON_ALIGNED __attribute__((aligned(64)))
+
+/*
+ * One sample of the timer stub
+ */
+typedef struct _gr_mon_sample {
+    uint64_t sample_count; // samples written so far, a gap means missed samples
+    uint64_t timestamp; // gr_clock_ns() when the sample was taken
+    uint64_t interval; // ns since the previous sample
     int phase_id;
-    long long perfctr_values[NUM_EVENTS];
+    long long perfctr_values[NUM_EVENTS]; // deltas since the previous sample
+    // metrics of the interval in perfctr_values, see GR_METRIC_*
+    double metrics[GR_NUM_METRICS];
+} gr_mon_sample, *gr_mon_sample_t;
+
+typedef struct _gr_mon_slot {
+    volatile uint32_t seq;
+    gr_mon_sample sample;
+} GR_MON_ALIGNED gr_mon_slot, *gr_mon_slot_t;
+
+typedef struct _gr_monitor_buffer {
+    uint64_t region_size; // bytes, including the ring; 0 until set up
+    uint32_t ring_depth; // a power of 2
+
+    // the simulation's event list, set at creation: perfctr_values[0..num_events)
+    // are in use and roles[r] is the index of the event with role r, or -1
+    int num_events;
+    int8_t roles[GR_NUM_ROLES];
+
+    // samples written by the timer stub so far
+    volatile uint64_t sample_head GR_MON_ALIGNED;
+
+    // idle window predicted at the start of the current phase
+    volatile uint32_t prediction_seq GR_MON_ALIGNED;
+    int predicted_phase_id;
+    uint64_t predicted_idle_length;
+    double predicted_confidence;
+
+    // running metrics of the phase that ended last
+    volatile uint32_t metrics_seq GR_MON_ALIGNED;
+    int metrics_phase_id;
+    double phase_metrics[GR_NUM_METRICS];
+
+    gr_mon_slot ring[] GR_MON_ALIGNED;
 } gr_mon_buffer, *gr_mon_buffer_t;
 
+static inline uint32_t gr_seq_write_begin(volatile uint32_t *seq)
+{
+    uint32_t s = *seq + 1;
+    __atomic_store_n(seq, s, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return s;
+}
+
+/*
+ * Take a section that has more than one writer: return 0 and the count to
+ * pass to gr_seq_write_end() in *s, or -1 if another writer holds it
+ */
+static inline int gr_seq_try_write_begin(volatile uint32_t *seq, uint32_t *s)
+{
+    uint32_t old = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    if((old & 1) || !__atomic_compare_exchange_n(seq, &old, old + 1, 0, 
+                                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *s = old + 1;
+    return 0;
+}
+
+static inline void gr_seq_write_end(volatile uint32_t *seq, uint32_t s)
+{
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t gr_seq_read_begin(volatile uint32_t *seq)
+{
+    uint32_t s;
+    int spins = 0;
+    while((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+        // the writer may have been preempted
+        if(++ spins % 1024 == 0) {
+            sched_yield();
+        }
+    }
+    return s;
+}
+
+/* Return non-zero if the section was written since gr_seq_read_begin() */
+static inline int gr_seq_read_retry(volatile uint32_t *seq, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+/*
+ * Create the monitor buffer of a simulation process. Environment variable
+ * GR_MON_RING_DEPTH sets the number of samples kept, rounded up to a power
+ * of 2.
+ */
 df_shm_region_t gr_create_monitor_buffer(df_shm_method_t shm_handle, key_t shm_key);
 
 int gr_destroy_monitor_buffer(df_shm_region_t region);
 
 df_shm_region_t gr_attach_monitor_buffer(df_shm_method_t shm_handle, key_t shm_key);
 
+/*
+ * Index in perfctr_values of the event the simulation tagged with the
+ * named role, or -1 if it does not monitor one
+ */
+int gr_mon_buffer_role_index(gr_mon_buffer_t mon_buffer, const char *role_name);
+
+/*
+ * Append a sample of the timer stub to the ring. Never blocks.
+ */
+void gr_publish_sample(gr_mon_buffer_t mon_buffer, 
+                       int phase_id, 
+                       uint64_t timestamp, 
+                       uint64_t interval,
+                       long long *perfctr_values, 
+                       double *metrics
+                      );
+
+/*
+ * Copy up to max_samples samples, starting after the first *next_sample
+ * samples, and advance *next_sample past them. Samples already overwritten
+ * are skipped; the gap shows in sample_count.
+ *
+ * Return the number of samples copied.
+ */
+int gr_read_samples(gr_mon_buffer_t mon_buffer, 
+                    uint64_t *next_sample, 
+                    gr_mon_sample_t samples, 
+                    int max_samples
+                   );
+
+/*
+ * Copy the latest sample of the timer stub. Return -1 if there is none yet.
+ */
+int gr_read_sample(gr_mon_buffer_t mon_buffer, gr_mon_sample_t sample);
+
+/*
+ * Publish the idle window predicted for the phase being entered. 
+ * Never blocks.
+ */
+int gr_publish_prediction(gr_mon_buffer_t mon_buffer, 
+                          int phase_id, 
+                          uint64_t idle_length, 
+                          double confidence
+                         );
+
+/*
+ * Publish the running metrics of a phase that has just ended.
+ * Never blocks.
+ */
+int gr_publish_phase_metrics(gr_mon_buffer_t mon_buffer, int phase_id, double *metrics);
+
 #endif
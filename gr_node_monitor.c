@@ -0,0 +1,210 @@
+/**
+ * Node-wide monitor region
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include "df_shm.h"
+#include "gr_perfctr.h"
+#include "gr_node_monitor.h"
+
+df_shm_region_t gr_create_node_monitor(df_shm_method_t shm_handle, 
+                                       key_t shm_key, 
+                                       int num_ranks, 
+                                       int threads_per_rank
+                                      )
+{
+    size_t region_size = sizeof(gr_node_mon) + 
+        (size_t) num_ranks * threads_per_rank * sizeof(gr_node_slot);
+    void *shm_region_name = (void *) &shm_key;
+    int shm_region_name_size = sizeof(shm_key);
+    df_shm_region_t region = df_create_named_shm_region(shm_handle,
+        shm_region_name, shm_region_name_size, region_size, NULL);
+    if(!region) {
+        fprintf(stderr, "Error: Cannot create shared memory for node monitor. %s:%d\n",
+            __FILE__, __LINE__);
+        return NULL;
+    }
+    gr_node_mon_t m = (gr_node_mon_t) region->starting_addr;
+    m->num_ranks = num_ranks;
+    m->threads_per_rank = threads_per_rank;
+    memset(&m->summary, 0, sizeof(gr_node_summary));
+    int i, k;
+    for(i = 0; i < num_ranks * threads_per_rank; i ++) {
+        gr_node_slot_t slot = &m->slots[i];
+        slot->seq = 0;
+        slot->in_phase = 0;
+        slot->phase_id = -1;
+        slot->timestamp = 0;
+        slot->interval = 0;
+        for(k = 0; k < GR_NUM_METRICS; k ++) {
+            slot->metrics[k] = -1;
+        }
+    }
+
+    // other ranks attach once the size is set
+    __atomic_store_n(&m->region_size, (uint64_t) region_size, __ATOMIC_RELEASE);
+    return region;
+}
+
+df_shm_region_t gr_attach_node_monitor(df_shm_method_t shm_handle, key_t shm_key)
+{
+    void *shm_region_name = (void *) &shm_key;
+    int shm_region_name_size = sizeof(shm_key);
+    df_shm_region_t region = df_attach_named_shm_region(shm_handle, shm_region_name,
+        shm_region_name_size, sizeof(gr_node_mon), NULL);
+    if(!region) {
+        return NULL;
+    }
+    gr_node_mon_t m = (gr_node_mon_t) region->starting_addr;
+    uint64_t size = __atomic_load_n(&m->region_size, __ATOMIC_ACQUIRE);
+    df_destroy_shm_region(region);
+    if(size == 0) {
+        // not set up yet
+        return NULL;
+    }
+    // map it again with the slots
+    return df_attach_named_shm_region(shm_handle, shm_region_name,
+        shm_region_name_size, size, NULL);
+}
+
+int gr_destroy_node_monitor(df_shm_region_t region)
+{
+    df_destroy_shm_region(region);
+    return 0;
+}
+
+void gr_node_publish_phase(gr_node_mon_t m, 
+                           int slot, 
+                           int in_phase, 
+                           int phase_id, 
+                           uint64_t timestamp
+                          )
+{
+    gr_node_slot_t s = &m->slots[slot];
+    uint32_t seq;
+    int spins = 0;
+    while(gr_seq_try_write_begin(&s->seq, &seq)) {
+        // a stub thread is publishing a sample into this slot
+        if(++ spins % 1024 == 0) {
+            sched_yield();
+        }
+    }
+    s->in_phase = in_phase;
+    s->phase_id = phase_id;
+    s->timestamp = timestamp;
+    gr_seq_write_end(&s->seq, seq);
+}
+
+void gr_node_publish_sample(gr_node_mon_t m, 
+                            int slot, 
+                            int phase_id, 
+                            uint64_t timestamp, 
+                            uint64_t interval, 
+                            double *metrics
+                           )
+{
+    gr_node_slot_t s = &m->slots[slot];
+    uint32_t seq;
+    if(gr_seq_try_write_begin(&s->seq, &seq)) {
+        // the stub interrupted this thread while it updated its slot, or
+        // the thread is updating it while the stub thread samples
+        return;
+    }
+    s->in_phase = 1; // the stub only runs inside phases
+    s->phase_id = phase_id;
+    s->timestamp = timestamp;
+    s->interval = interval;
+    memcpy(s->metrics, metrics, sizeof(double)*GR_NUM_METRICS);
+    gr_seq_write_end(&s->seq, seq);
+}
+
+void gr_node_read_slot(gr_node_mon_t m, int slot, gr_node_slot_t out)
+{
+    gr_node_slot_t s = &m->slots[slot];
+    uint32_t seq;
+    do {
+        seq = gr_seq_read_begin(&s->seq);
+        memcpy((void *) out, (void *) s, sizeof(gr_node_slot));
+    } while(gr_seq_read_retry(&s->seq, seq));
+}
+
+/*
+ * Copy a slot unless its writer is updating it. The summary is taken by
+ * the leader's stub, which may have interrupted the writer, so it must
+ * not wait. Return -1 if the slot is busy.
+ */
+static int gr_node_try_read_slot(gr_node_mon_t m, int slot, gr_node_slot_t out)
+{
+    gr_node_slot_t s = &m->slots[slot];
+    int tries;
+    for(tries = 0; tries < 16; tries ++) {
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            continue;
+        }
+        memcpy((void *) out, (void *) s, sizeof(gr_node_slot));
+        if(!gr_seq_read_retry(&s->seq, seq)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void gr_node_summarize(gr_node_mon_t m, gr_node_summary_t summary, uint64_t timestamp)
+{
+    int num_slots = m->num_ranks * m->threads_per_rank;
+    int num_in_phase = 0, num_measured = 0;
+    double ipc = 0, mpki = 0, bandwidth = 0;
+    int i;
+    for(i = 0; i < num_slots; i ++) {
+        gr_node_slot slot;
+        if(gr_node_try_read_slot(m, i, &slot) || !slot.in_phase) {
+            continue;
+        }
+        num_in_phase ++;
+        if(slot.metrics[GR_METRIC_IPC] < 0) {
+            continue;
+        }
+        num_measured ++;
+        ipc += slot.metrics[GR_METRIC_IPC];
+        if(slot.metrics[GR_METRIC_MPKI] >= 0) {
+            mpki += slot.metrics[GR_METRIC_MPKI];
+        }
+        if(slot.metrics[GR_METRIC_BANDWIDTH] >= 0) {
+            bandwidth += slot.metrics[GR_METRIC_BANDWIDTH];
+        }
+    }
+    summary->num_in_phase = num_in_phase;
+    summary->num_measured = num_measured;
+    summary->timestamp = timestamp;
+    summary->ipc = num_measured ? ipc / num_measured : -1;
+    summary->mpki = num_measured ? mpki / num_measured : -1;
+    summary->bandwidth = bandwidth;
+}
+
+void gr_node_publish_summary(gr_node_mon_t m, uint64_t timestamp)
+{
+    gr_node_summary summary;
+    gr_node_summarize(m, &summary, timestamp);
+    uint32_t seq = gr_seq_write_begin(&m->summary.seq);
+    m->summary.num_in_phase = summary.num_in_phase;
+    m->summary.num_measured = summary.num_measured;
+    m->summary.timestamp = summary.timestamp;
+    m->summary.ipc = summary.ipc;
+    m->summary.mpki = summary.mpki;
+    m->summary.bandwidth = summary.bandwidth;
+    gr_seq_write_end(&m->summary.seq, seq);
+}
+
+void gr_node_read_summary(gr_node_mon_t m, gr_node_summary_t out)
+{
+    uint32_t seq;
+    do {
+        seq = gr_seq_read_begin(&m->summary.seq);
+        memcpy((void *) out, (void *) &m->summary, sizeof(gr_node_summary));
+    } while(gr_seq_read_retry(&m->summary.seq, seq));
+}
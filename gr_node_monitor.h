@@ -0,0 +1,123 @@
+#ifndef _GR_NODE_MONITOR_H_
+#define _GR_NODE_MONITOR_H_
+/**
+ * Node-wide monitor region
+ *
+ * One shared region per simulation and node, with a cache line slot for
+ * each thread of each simulation rank on the node and a node summary
+ * slot. Slots are guarded by a sequence count as in the monitor buffer and
+ * never share a line. The slot of a rank's main thread is also written by
+ * its stub, which may run on a thread of its own; both take the slot with
+ * gr_seq_try_write_begin(), and the stub drops a sample rather than wait.
+ */
+#include <sys/ipc.h>
+#include <stdint.h>
+#include "gr_perfctr.h"
+#include "gr_monitor_buffer.h"
+#include "df_shm.h"
+
+#define GR_NODE_MONITOR_KEY_BASE 1700 // plus the simulation's application id
+#define GR_NODE_MONITOR_DEFAULT_THREADS 1 // slots per rank, the main thread only
+
+/*
+ * What a thread of a simulation rank is doing. The main thread's metrics
+ * come from its timer stub; other threads only publish their phase.
+ */
+typedef struct _gr_node_slot {
+    volatile uint32_t seq;
+    int in_phase; // inside an outermost phase
+    int phase_id; // that phase, or the last one, -1 if unknown
+    uint64_t timestamp; // gr_clock_ns() of the last update
+    uint64_t interval; // ns covered by metrics
+    double metrics[GR_NUM_METRICS]; // -1 if not measured
+} GR_MON_ALIGNED gr_node_slot, *gr_node_slot_t;
+
+/*
+ * Load of the whole node, refreshed by the local leader's stub
+ */
+typedef struct _gr_node_summary {
+    volatile uint32_t seq;
+    int num_in_phase; // slots inside a phase
+    int num_measured; // slots inside a phase with metrics
+    uint64_t timestamp;
+    double ipc; // mean over num_measured slots
+    double mpki; // mean over num_measured slots
+    double bandwidth; // sum over num_measured slots, bytes per second
+} GR_MON_ALIGNED gr_node_summary, *gr_node_summary_t;
+
+typedef struct _gr_node_mon {
+    uint64_t region_size; // bytes; 0 until set up
+    int num_ranks;
+    int threads_per_rank;
+    gr_node_summary summary;
+    gr_node_slot slots[] GR_MON_ALIGNED; // rank * threads_per_rank + thread
+} gr_node_mon, *gr_node_mon_t;
+
+/*
+ * Slot of a thread of a local rank, or -1 if the region has none for it.
+ * Threads are numbered as their phase contexts (gr_phase_ctx tid).
+ */
+static inline int gr_node_slot_index(gr_node_mon_t m, int local_rank, int tid)
+{
+    if(local_rank >= m->num_ranks || tid >= m->threads_per_rank) {
+        return -1;
+    }
+    return local_rank * m->threads_per_rank + tid;
+}
+
+/*
+ * Create the region for num_ranks ranks with threads_per_rank slots each.
+ * Called by the local leader of the simulation.
+ */
+df_shm_region_t gr_create_node_monitor(df_shm_method_t shm_handle, 
+                                       key_t shm_key, 
+                                       int num_ranks, 
+                                       int threads_per_rank
+                                      );
+
+/*
+ * Attach to the region if it is set up, without waiting. Return NULL if
+ * it is not, e.g. the simulation was started without it.
+ */
+df_shm_region_t gr_attach_node_monitor(df_shm_method_t shm_handle, key_t shm_key);
+
+int gr_destroy_node_monitor(df_shm_region_t region);
+
+/*
+ * Publish that a thread has entered or left its outermost phase. 
+ * The metrics are left as they are.
+ */
+void gr_node_publish_phase(gr_node_mon_t m, 
+                           int slot, 
+                           int in_phase, 
+                           int phase_id, 
+                           uint64_t timestamp
+                          );
+
+/*
+ * Publish a stub sample of a rank's main thread
+ */
+void gr_node_publish_sample(gr_node_mon_t m, 
+                            int slot, 
+                            int phase_id, 
+                            uint64_t timestamp, 
+                            uint64_t interval, 
+                            double *metrics
+                           );
+
+void gr_node_read_slot(gr_node_mon_t m, int slot, gr_node_slot_t out);
+
+/*
+ * Fold all slots into summary, which need not be in the region. Never
+ * waits: a slot being updated is left out.
+ */
+void gr_node_summarize(gr_node_mon_t m, gr_node_summary_t summary, uint64_t timestamp);
+
+/*
+ * Refresh the summary slot. Only the local leader calls this.
+ */
+void gr_node_publish_summary(gr_node_mon_t m, uint64_t timestamp);
+
+void gr_node_read_summary(gr_node_mon_t m, gr_node_summary_t out);
+
+#endif
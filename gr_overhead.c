@@ -0,0 +1,93 @@
+/**
+ * Calibration of the instrumentation overhead
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include "rdtsc.h"
+#include "gr_perfctr.h"
+#include "gr_stub.h"
+#include "gr_overhead.h"
+
+gr_overhead gr_overhead_cost = {0, 0, 0, 0};
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t gr_median(uint64_t *samples, int n)
+{
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    return samples[n / 2];
+}
+
+/*
+ * Time between two back-to-back clock reads, i.e. the cost of one read as
+ * seen inside a measured interval
+ */
+static uint64_t gr_calibrate_clock()
+{
+    uint64_t samples[GR_OVERHEAD_CALIBRATION_ROUNDS];
+    int i;
+    for(i = 0; i < GR_OVERHEAD_CALIBRATION_ROUNDS; i ++) {
+        uint64_t t0 = gr_clock_ns_fenced();
+        uint64_t t1 = gr_clock_ns_fenced();
+        samples[i] = t1 - t0;
+    }
+    return gr_median(samples, GR_OVERHEAD_CALIBRATION_ROUNDS);
+}
+
+#ifdef GR_HAVE_PERFCTR
+static uint64_t gr_calibrate_perfctr()
+{
+    uint64_t samples[GR_OVERHEAD_CALIBRATION_ROUNDS];
+    long long values[NUM_EVENTS];
+    int i;
+    for(i = 0; i < GR_OVERHEAD_CALIBRATION_ROUNDS; i ++) {
+        uint64_t t0 = gr_clock_ns_fenced();
+        if(gr_perfctr_read(values)) {
+            return 0;
+        }
+        uint64_t t1 = gr_clock_ns_fenced();
+        samples[i] = t1 - t0;
+    }
+    uint64_t cost = gr_median(samples, GR_OVERHEAD_CALIBRATION_ROUNDS);
+    return (cost > gr_overhead_cost.clock_read) ? cost - gr_overhead_cost.clock_read : 0;
+}
+#endif
+
+int gr_overhead_calibrate(int do_perfctr, int do_stub)
+{
+    gr_overhead_cost.clock_read = gr_calibrate_clock();
+#ifdef GR_HAVE_PERFCTR
+    if(do_perfctr && gr_perfctr_is_on()) {
+        gr_overhead_cost.perfctr_read = gr_calibrate_perfctr();
+    }
+#endif
+    if(do_stub) {
+        uint64_t arm, disarm;
+        if(gr_stub_calibrate(GR_OVERHEAD_CALIBRATION_ROUNDS, &arm, &disarm)) {
+            return -1;
+        }
+        gr_overhead_cost.stub_arm = (arm > gr_overhead_cost.clock_read) ? 
+            arm - gr_overhead_cost.clock_read : 0;
+        gr_overhead_cost.stub_disarm = (disarm > gr_overhead_cost.clock_read) ? 
+            disarm - gr_overhead_cost.clock_read : 0;
+    }
+    return 0;
+}
+
+void gr_overhead_print(FILE *log_file)
+{
+    fprintf(log_file, "overhead(ns):\tclock_read\tperfctr_read\tstub_arm\tstub_disarm\n");
+    fprintf(log_file, "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+        gr_overhead_cost.clock_read,
+        gr_overhead_cost.perfctr_read,
+        gr_overhead_cost.stub_arm,
+        gr_overhead_cost.stub_disarm);
+}
@@ -0,0 +1,35 @@
+#ifndef _GR_OVERHEAD_H_
+#define _GR_OVERHEAD_H_
+/**
+ * Instrumentation overhead
+ *
+ * The cost of what GoldRush itself does inside a measured phase: clock and
+ * counter reads, arming the stub timer and the timer handler. These are 
+ * measured once at startup on the running node, subtracted from phase 
+ * lengths and reported separately.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#define GR_OVERHEAD_CALIBRATION_ROUNDS 255
+
+typedef struct _gr_overhead {
+    uint64_t clock_read;   // in ns, as all costs
+    uint64_t perfctr_read;
+    uint64_t stub_arm;
+    uint64_t stub_disarm;
+} gr_overhead, *gr_overhead_t;
+
+extern gr_overhead gr_overhead_cost;
+
+/*
+ * Measure the median cost of each instrumentation step. Counter reads and
+ * the stub are only measured if they are in use.
+ *
+ * Return 0 for success and -1 for error.
+ */
+int gr_overhead_calibrate(int do_perfctr, int do_stub);
+
+void gr_overhead_print(FILE *log_file);
+
+#endif
@@ -1,102 +1,269 @@
+
+#include <signal.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include "papi.h"
 #include "gr_perfctr.h"
+#include "gr_perfctr_backend.h"
+
+#ifndef GR_PERFCTR_DEFAULT_BACKEND
+#ifdef GR_NO_PAPI
+#define GR_PERFCTR_DEFAULT_BACKEND "perf"
+#else
+#define GR_PERFCTR_DEFAULT_BACKEND "papi"
+#endif
+#endif
 
 /*
  * hardware performance counter events to monitor
  */
-static int *gr_PAPI_events = NULL;
-static char **gr_PAPI_enames = NULL;
+static char *gr_event_names[NUM_EVENTS];
 static int gr_num_events = 0;
 
-static int gr_PAPI_eventset = PAPI_NULL ;
+/*
+ * index of the event playing each role, -1 if none
+ */
+static int gr_event_roles[GR_NUM_ROLES] = {-1, -1, -1, -1, -1, -1};
+
+/*
+ * event groups counted in turn, as indices into gr_event_names. The backend
+ * only counts gr_current_group; gr_group_mask has a bit set for each of its
+ * events.
+ */
+static int gr_group_events[GR_PERFCTR_MAX_GROUPS][NUM_EVENTS];
+static int gr_group_sizes[GR_PERFCTR_MAX_GROUPS];
+static int gr_num_groups = 1;
+static int gr_current_group = 0;
+static unsigned int gr_group_mask = 0;
+static int gr_rotate_interval = 1;
+static int gr_rotate_count = 0;
+
+/*
+ * counter values read last at a phase transition on the main thread, and
+ * when, in ns (0 if none is valid). The stub handler can interrupt an
+ * update, it ignores the snapshot while gr_snapshot_busy is set.
+ */
+static long long gr_snapshot_values[NUM_EVENTS];
+static uint64_t gr_snapshot_time = 0;
+static volatile sig_atomic_t gr_snapshot_busy = 0;
+
+static const char *gr_role_names[GR_NUM_ROLES] = {
+    "cycles", "instructions", "llc-misses", "stalls", "task-clock", "run-delay"
+};
+
+/*
+ * events whose role is known without a tag
+ */
+static const struct {
+    const char *event_name;
+    int role;
+} gr_known_roles[] = {
+    {"PAPI_TOT_CYC", GR_ROLE_CYCLES},
+    {"cycles", GR_ROLE_CYCLES},
+    {"PAPI_TOT_INS", GR_ROLE_INSTRUCTIONS},
+    {"instructions", GR_ROLE_INSTRUCTIONS},
+    {"PAPI_L3_TCM", GR_ROLE_LLC_MISSES},
+    {"PAPI_L3_LDM", GR_ROLE_LLC_MISSES},
+    {"cache-misses", GR_ROLE_LLC_MISSES},
+    {"LLC-load-misses", GR_ROLE_LLC_MISSES},
+    {"PAPI_RES_STL", GR_ROLE_STALLS},
+    {"PAPI_STL_ICY", GR_ROLE_STALLS},
+    {"stalled-cycles-backend", GR_ROLE_STALLS},
+    {"stalled-cycles-frontend", GR_ROLE_STALLS},
+    {"task-clock", GR_ROLE_TASK_CLOCK},
+    {"run-delay", GR_ROLE_RUN_DELAY},
+};
+
+static gr_perfctr_backend_t gr_perfctr_ops = NULL;
 static int is_counting = 0;
 
 /* Forward declarations */
 int gr_perfctr_start(int mpi_rank);
 int gr_perfctr_stop(int mpi_rank);
 
+static gr_perfctr_backend_t gr_perfctr_find_backend(const char *name)
+{
+#ifndef GR_NO_PAPI
+    if(!strcmp(name, gr_perfctr_papi_backend.name)) {
+        return &gr_perfctr_papi_backend;
+    }
+#endif
+#ifdef __linux__
+    if(!strcmp(name, gr_perfctr_perf_backend.name)) {
+        return &gr_perfctr_perf_backend;
+    }
+    if(!strcmp(name, gr_perfctr_sw_backend.name)) {
+        return &gr_perfctr_sw_backend;
+    }
+#endif
+    return NULL;
+}
+
+/*
+ * Add the event named by the first len characters of str, with an optional
+ * "@role" tag, to event group group. An event in several groups is
+ * monitored once, under one index.
+ */
+static int gr_perfctr_add_event(int mpi_rank, int group, const char *str, size_t len)
+{
+    char *name = strndup(str, len);
+    if(!name) {
+        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n",
+            __FILE__, __LINE__);
+        return -1;
+    }
+    int role = -1;
+    char *role_str = strchr(name, '@');
+    if(role_str) {
+        *role_str = '\0';
+        role = gr_perfctr_role_by_name(role_str + 1);
+        if(role == -1) {
+            fprintf(stderr, "Error: rank %d unknown role %s of event %s. %s:%d\n",
+                mpi_rank, role_str + 1, name, __FILE__, __LINE__);
+            free(name);
+            return -1;
+        }
+    }
+
+    int index = gr_perfctr_event_index(name);
+    if(index == -1) {
+        if(gr_num_events == NUM_EVENTS) {
+            fprintf(stderr, "Error: rank %d more than %d events. %s:%d\n",
+                mpi_rank, NUM_EVENTS, __FILE__, __LINE__);
+            free(name);
+            return -1;
+        }
+        index = gr_num_events ++;
+        gr_event_names[index] = name;
+fprintf(stderr, "event %s\n", gr_event_names[index]);
+    }
+    else {
+        free(name);
+    }
+    if(role != -1) {
+        gr_event_roles[role] = index;
+    }
+
+    int i;
+    for(i = 0; i < gr_group_sizes[group]; i ++) {
+        if(gr_group_events[group][i] == index) {
+            return 0;
+        }
+    }
+    gr_group_events[group][gr_group_sizes[group] ++] = index;
+    return 0;
+}
+
+/*
+ * Set up event group group in the backend
+ */
+static int gr_perfctr_init_group(int mpi_rank, int group)
+{
+    char *names[NUM_EVENTS];
+    int i;
+    for(i = 0; i < gr_group_sizes[group]; i ++) {
+        names[i] = gr_event_names[gr_group_events[group][i]];
+    }
+    return gr_perfctr_ops->init(mpi_rank, group, names, gr_group_sizes[group]);
+}
+
+/*
+ * Make event group group the one counted from the next start on
+ */
+static int gr_perfctr_select_group(int mpi_rank, int group)
+{
+    if(gr_perfctr_ops->select(mpi_rank, group)) {
+        return -1;
+    }
+    int i;
+    gr_group_mask = 0;
+    for(i = 0; i < gr_group_sizes[group]; i ++) {
+        gr_group_mask |= 1u << gr_group_events[group][i];
+    }
+    gr_current_group = group;
+    return 0;
+}
+
+/*
+ * Give roles not tagged explicitly to the first event known to play them
+ */
+static void gr_perfctr_infer_roles()
+{
+    int i;
+    size_t k;
+    for(i = 0; i < gr_num_events; i ++) {
+        for(k = 0; k < sizeof(gr_known_roles) / sizeof(gr_known_roles[0]); k ++) {
+            int role = gr_known_roles[k].role;
+            if(gr_event_roles[role] == -1 && !strcmp(gr_event_names[i], gr_known_roles[k].event_name)) {
+                gr_event_roles[role] = i;
+            }
+        }
+    }
+}
+
 /*
  * Initialize hardware performance counter monitoring.
  */ 
 int gr_perfctr_init(int mpi_rank)
 {
-    int rc = PAPI_library_init(PAPI_VER_CURRENT);
-    if(rc != PAPI_VER_CURRENT) {
-        fprintf(stderr, "Error: rank %d PAPI error: %d %d:%s. %s:%d\n", 
-            mpi_rank, rc, PAPI_VER_CURRENT, PAPI_strerror(rc), __FILE__, __LINE__);
-        return -1;
+    // pass environment variable "GR_PERFCTR_BACKEND" to choose the backend
+    char *backend_name = getenv("GR_PERFCTR_BACKEND");
+    if(!backend_name) {
+        backend_name = GR_PERFCTR_DEFAULT_BACKEND;
     }
- 
-    rc = PAPI_create_eventset(&gr_PAPI_eventset); 
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
-            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+    gr_perfctr_ops = gr_perfctr_find_backend(backend_name);
+    if(!gr_perfctr_ops) {
+        fprintf(stderr, "Error: rank %d unknown performance counter backend %s. %s:%d\n",
+            mpi_rank, backend_name, __FILE__, __LINE__);
         return -1;
     }
 
-    // pass environment variable "GR_PERFCTR_EVENTS" to get events
-    char *gr_perfctr_events = getenv("GR_PERFCTR_EVENTS");
+    // pass environment variable "GR_PERFCTR_EVENTS" to get events, e.g.
+    // "PAPI_TOT_CYC;PAPI_TOT_INS;PAPI_L2_TCM@llc-misses|PAPI_TOT_CYC;PAPI_RES_STL"
+    const char *gr_perfctr_events = getenv("GR_PERFCTR_EVENTS");
+    if(!gr_perfctr_events) {
+        gr_perfctr_events = gr_perfctr_ops->default_events;
+    }
+    int group = 0;
+    gr_group_sizes[0] = 0;
     while(gr_perfctr_events && *gr_perfctr_events != '\0') {
-        char *temp_str = strchr(gr_perfctr_events, ';');
-        if(temp_str) {
-            *temp_str = '\0';
-            temp_str ++;
-        }
-        int event_code;
-        rc = PAPI_event_name_to_code(gr_perfctr_events, &event_code);    
-        if(rc != PAPI_OK) {
-            fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n",
-                mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+        const char *temp_str = strpbrk(gr_perfctr_events, ";|");
+        size_t len = temp_str ? (size_t) (temp_str - gr_perfctr_events) : strlen(gr_perfctr_events);
+        if(len > 0 && gr_perfctr_add_event(mpi_rank, group, gr_perfctr_events, len)) {
             return -1;
         }
-        rc = PAPI_add_event(gr_PAPI_eventset, event_code);
-        if(rc != PAPI_OK) {
-            fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
-                mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
-            return -1;
-        }
-        if(!gr_PAPI_events) {
-            gr_PAPI_events = (int *) malloc(sizeof(int)); 
-            if(!gr_PAPI_events) {
-                fprintf(stderr, "Error: cannot allocate memory. %s:%d\n",
-                    __FILE__, __LINE__);
-                return -1;
-            } 
-        }         
-        else {
-            gr_PAPI_events = (int *) realloc(gr_PAPI_events, (gr_num_events+1)*sizeof(int));
-            if(!gr_PAPI_events) {
-                fprintf(stderr, "Error: cannot allocate memory. %s:%d\n",
-                    __FILE__, __LINE__);
+        if(temp_str && *temp_str == '|') {
+            // start the next event group
+            if(gr_group_sizes[group] == 0 || group + 1 == GR_PERFCTR_MAX_GROUPS) {
+                fprintf(stderr, "Error: rank %d empty event group or more than %d groups. %s:%d\n",
+                    mpi_rank, GR_PERFCTR_MAX_GROUPS, __FILE__, __LINE__);
                 return -1;
             }
+            gr_group_sizes[++ group] = 0;
         }
-        if(!gr_PAPI_enames) {
-            gr_PAPI_enames = (char **) malloc(sizeof(char *));
-            if(!gr_PAPI_enames) {
-                fprintf(stderr, "Error: cannot allocate memory. %s:%d\n",
-                    __FILE__, __LINE__);
-                return -1;
-            }
+        gr_perfctr_events = temp_str ? temp_str + 1 : NULL;
+    }
+    gr_num_groups = (gr_group_sizes[group] == 0 && group > 0) ? group : group + 1;
+    gr_perfctr_infer_roles();
+
+    // pass environment variable "GR_PERFCTR_ROTATE" to set how many outermost
+    // phases each event group counts before the next group takes over
+    char *rotate_str = getenv("GR_PERFCTR_ROTATE");
+    if(rotate_str) {
+        gr_rotate_interval = atoi(rotate_str);
+        if(gr_rotate_interval < 1) {
+            gr_rotate_interval = 1;
         }
-        else {
-            gr_PAPI_enames = (char **) realloc(gr_PAPI_enames, (gr_num_events+1)*sizeof(char *));
-            if(!gr_PAPI_enames) {
-                fprintf(stderr, "Error: cannot allocate memory. %s:%d\n",
-                    __FILE__, __LINE__);
-                return -1;
-            }
+    }
+    gr_rotate_count = 0;
+    for(group = 0; group < gr_num_groups; group ++) {
+        if(gr_perfctr_init_group(mpi_rank, group)) {
+            gr_perfctr_finalize(mpi_rank);
+            return -1;
         }
-fprintf(stderr, "event %s\n", gr_perfctr_events);
-        gr_PAPI_events[gr_num_events] = event_code;
-        gr_PAPI_enames[gr_num_events] = strdup(gr_perfctr_events);
-        gr_num_events ++;
-        gr_perfctr_events = temp_str;
     }
-    return 0;
+    return gr_perfctr_select_group(mpi_rank, 0);
 }
 
 /*
@@ -104,30 +271,26 @@ fprintf(stderr, "event %s\n", gr_perfctr_events);
  */
 int gr_perfctr_finalize(int mpi_rank)
 {
+    if(!gr_perfctr_ops) {
+        return 0;
+    }
     // stop counting
     gr_perfctr_stop(mpi_rank);
 
-    int rc = PAPI_cleanup_eventset(gr_PAPI_eventset);
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
-            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
-        return -1;
-    }
-    rc = PAPI_destroy_eventset(&gr_PAPI_eventset);    
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
-            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
-        return -1;
-    }
-    PAPI_shutdown();
+    int rc = gr_perfctr_ops->finalize(mpi_rank);
 
-    free(gr_PAPI_events);
     int i;
     for(i = 0; i < gr_num_events; i ++) {
-        free(gr_PAPI_enames[i]);
+        free(gr_event_names[i]);
     }
-    free(gr_PAPI_enames);
-    return 0;
+    gr_num_events = 0;
+    gr_num_groups = 1;
+    gr_group_mask = 0;
+    for(i = 0; i < GR_NUM_ROLES; i ++) {
+        gr_event_roles[i] = -1;
+    }
+    gr_perfctr_ops = NULL;
+    return rc;
 }
 
 /*
@@ -138,12 +301,11 @@ int gr_perfctr_start(int mpi_rank)
     if(is_counting) {
         return 0;
     }
-    int rc = PAPI_start(gr_PAPI_eventset);
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
-            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+    if(!gr_perfctr_ops || gr_perfctr_ops->start(mpi_rank)) {
         return -1;
     }
+    // backends may reset the counters when they start
+    gr_snapshot_time = 0;
     is_counting = 1;
     return 0;
 }
@@ -156,12 +318,7 @@ int gr_perfctr_stop(int mpi_rank)
     if(!is_counting) {
         return 0;
     }
-    
-    long long values[gr_num_events];
-    int rc = PAPI_stop(gr_PAPI_eventset, values);
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
-            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+    if(gr_perfctr_ops->stop(mpi_rank)) {
         return -1;
     }
     is_counting = 0;
@@ -184,9 +341,14 @@ int gr_perfctr_init_counter(gr_perfctr_t counter)
     int i;
     for(i = 0 ; i < gr_num_events; i ++) {
         counter->avg_values[i] = 0;
+        counter->event_count[i] = 0;
         counter->min_values[i] = -1;
         counter->max_values[i] = -1;
     }
+    for(i = 0; i < GR_NUM_METRICS; i ++) {
+        counter->metrics[i] = 0;
+        counter->metric_count[i] = 0;
+    }
     counter->count = 0;
     return 0;
 }
@@ -196,53 +358,116 @@ int gr_perfctr_init_counter(gr_perfctr_t counter)
  */
 int gr_perfctr_read(long long *values)
 {
-    int rc = PAPI_read(gr_PAPI_eventset, values);
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: PAPI error: %s. %s:%d\n", 
-            PAPI_strerror(rc), __FILE__, __LINE__);
+    if(!gr_perfctr_ops) {
         return -1;
-    }  
+    }
+    if(gr_num_groups == 1) {
+        // the only group lists every event in order
+        return gr_perfctr_ops->read(values);
+    }
+    long long group_values[NUM_EVENTS];
+    if(gr_perfctr_ops->read(group_values)) {
+        return -1;
+    }
+    int i;
+    for(i = 0; i < gr_num_events; i ++) {
+        values[i] = 0;
+    }
+    int *events = gr_group_events[gr_current_group];
+    for(i = 0; i < gr_group_sizes[gr_current_group]; i ++) {
+        values[events[i]] = group_values[i];
+    }
     return 0;
 }
 
 /*
- * Read performance counter values at the start of a phase
+ * Read counter values at a phase transition on the main thread. The values
+ * of the last transition are reused if they were read less than max_age
+ * ns before now, so back-to-back phases share one read.
+ *
+ * Return 1 if the snapshot was reused, 0 if the counters were read, or -1
+ * for error.
  */
-int gr_perfctr_phase_start(gr_perfctr_t counter)
+int gr_perfctr_snapshot(long long *values, uint64_t now, uint64_t max_age)
 {
-    int rc = PAPI_read(gr_PAPI_eventset, counter->start_values);
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: PAPI error: %s. %s:%d\n",
-            PAPI_strerror(rc), __FILE__, __LINE__);
+    if(gr_snapshot_time != 0 && now - gr_snapshot_time < max_age) {
+        memcpy(values, gr_snapshot_values, gr_num_events * sizeof(long long));
+        return 1;
+    }
+    if(gr_perfctr_read(values)) {
         return -1;
     }
+    gr_snapshot_busy = 1;
+    __asm__ __volatile__ ("" ::: "memory");
+    memcpy(gr_snapshot_values, values, gr_num_events * sizeof(long long));
+    gr_snapshot_time = now;
+    __asm__ __volatile__ ("" ::: "memory");
+    gr_snapshot_busy = 0;
     return 0;
 }
 
+/*
+ * Like gr_perfctr_snapshot(), but never replaces the snapshot, so it can be
+ * called from a signal handler on the main thread.
+ */
+int gr_perfctr_read_recent(long long *values, uint64_t now, uint64_t max_age)
+{
+    if(!gr_snapshot_busy && gr_snapshot_time != 0 && now - gr_snapshot_time < max_age) {
+        memcpy(values, gr_snapshot_values, gr_num_events * sizeof(long long));
+        return 1;
+    }
+    return gr_perfctr_read(values);
+}
+
+/*
+ * Count one occurrence of an outermost phase, and switch the backend to the
+ * next event group every gr_rotate_interval occurrences. The groups were
+ * set up at init, so this only stops one and starts the next. Must be
+ * called between phases, when no counter values are held for a later
+ * difference.
+ */
+int gr_perfctr_rotate(int mpi_rank)
+{
+    if(gr_num_groups == 1 || ++ gr_rotate_count < gr_rotate_interval) {
+        return 0;
+    }
+    gr_rotate_count = 0;
+    gr_snapshot_time = 0;
+    int was_counting = is_counting;
+    if(was_counting) {
+        gr_perfctr_stop(mpi_rank);
+    }
+    if(gr_perfctr_select_group(mpi_rank, (gr_current_group + 1) % gr_num_groups)) {
+        return -1;
+    }
+    if(was_counting) {
+        return gr_perfctr_start(mpi_rank);
+    }
+    return 0;
+}
+
+/*
+ * Read performance counter values at the start of a phase
+ */
+int gr_perfctr_phase_start(gr_perfctr_t counter)
+{
+    return gr_perfctr_read(counter->start_values);
+}
+
 /*
  * Read performance counter values at the end of a phase
  */
 int gr_perfctr_phase_end(gr_perfctr_t counter)
 {
-    long long values[gr_num_events];
-    int rc = PAPI_read(gr_PAPI_eventset, values);
-    if(rc != PAPI_OK) {
-        fprintf(stderr, "Error: PAPI error: %s. %s:%d\n",
-            PAPI_strerror(rc), __FILE__, __LINE__);
+    long long values[NUM_EVENTS];
+    if(gr_perfctr_read(values)) {
         return -1;
     }
-    counter->count ++;
     int i;
     for(i = 0; i < gr_num_events; i ++) {
-        long long t = values[i] - counter->start_values[i];
-        counter->avg_values[i] += t;
-        if(t < counter->min_values[i] || counter->min_values[i] == -1) {
-            counter->min_values[i] = t;
-        }
-        if(t > counter->max_values[i]) {
-            counter->max_values[i] = t;
-        }
+        values[i] -= counter->start_values[i];
     }
+    gr_perfctr_update(counter, values);
     return 0;
 }
 
@@ -254,6 +479,11 @@ void gr_perfctr_update(gr_perfctr_t counter, long long *pctr_values)
     counter->count ++;
     int i;
     for(i = 0; i < gr_num_events; i ++) {
+        if(!(gr_group_mask & (1u << i))) {
+            // not counted by the current event group
+            continue;
+        }
+        counter->event_count[i] ++;
         counter->avg_values[i] += pctr_values[i];
         if(pctr_values[i] < counter->min_values[i] || counter->min_values[i] == -1) {
             counter->min_values[i] = pctr_values[i];
@@ -264,6 +494,171 @@ void gr_perfctr_update(gr_perfctr_t counter, long long *pctr_values)
     }
 }
 
+/*
+ * Value of the event with the given role, or -1 if it is not counted now
+ */
+static inline double gr_perfctr_role_value(long long *pctr_values, int role)
+{
+    int i = gr_event_roles[role];
+    if(i == -1 || !(gr_group_mask & (1u << i))) {
+        return -1;
+    }
+    return (double) pctr_values[i];
+}
+
+void gr_perfctr_compute_metrics(long long *pctr_values, uint64_t length, double *metrics)
+{
+    double cycles = gr_perfctr_role_value(pctr_values, GR_ROLE_CYCLES);
+    double instructions = gr_perfctr_role_value(pctr_values, GR_ROLE_INSTRUCTIONS);
+    double misses = gr_perfctr_role_value(pctr_values, GR_ROLE_LLC_MISSES);
+
+    metrics[GR_METRIC_IPC] = (cycles > 0 && instructions >= 0) ? instructions / cycles : -1;
+    metrics[GR_METRIC_MPKI] = (instructions > 0 && misses >= 0) ? misses * 1000 / instructions : -1;
+    metrics[GR_METRIC_BANDWIDTH] = (length > 0 && misses >= 0) ? 
+        misses * GR_LLC_LINE_SIZE * 1e9 / length : -1;
+}
+
+void gr_perfctr_update_metrics(gr_perfctr_t counter, long long *pctr_values, uint64_t length)
+{
+    double metrics[GR_NUM_METRICS];
+    gr_perfctr_compute_metrics(pctr_values, length, metrics);
+    int i;
+    for(i = 0; i < GR_NUM_METRICS; i ++) {
+        if(metrics[i] < 0) {
+            continue;
+        }
+        counter->metric_count[i] ++;
+        counter->metrics[i] += (metrics[i] - counter->metrics[i]) / counter->metric_count[i];
+    }
+}
+
+/*
+ * Sum of the values of event i, scaled to all occurrences of the phase
+ */
+double gr_perfctr_scaled_sum(gr_perfctr_t c, int i)
+{
+    if(c->event_count[i] == 0) {
+        return 0;
+    }
+    return (double) c->avg_values[i] * c->count / c->event_count[i];
+}
+
+/*
+ * Merge the statistics of counter src into counter dst
+ */
+void gr_perfctr_merge(gr_perfctr_t dst, gr_perfctr_t src)
+{
+    int i;
+    for(i = 0; i < gr_num_events; i ++) {
+        dst->avg_values[i] += src->avg_values[i];
+        dst->event_count[i] += src->event_count[i];
+        if(src->min_values[i] != -1 && 
+           (src->min_values[i] < dst->min_values[i] || dst->min_values[i] == -1)) {
+            dst->min_values[i] = src->min_values[i];
+        }
+        if(src->max_values[i] > dst->max_values[i]) {
+            dst->max_values[i] = src->max_values[i];
+        }
+    }
+    for(i = 0; i < GR_NUM_METRICS; i ++) {
+        long long n = dst->metric_count[i] + src->metric_count[i];
+        if(n > 0) {
+            dst->metrics[i] = (dst->metrics[i] * dst->metric_count[i] +
+                               src->metrics[i] * src->metric_count[i]) / n;
+        }
+        dst->metric_count[i] = n;
+    }
+    dst->count += src->count;
+}
+
+/*
+ * Name of the backend in use, or NULL before gr_perfctr_init()
+ */
+const char *gr_perfctr_backend_name()
+{
+    return gr_perfctr_ops ? gr_perfctr_ops->name : NULL;
+}
+
+/*
+ * Whether gr_perfctr_read() works from threads other than the one which
+ * called gr_perfctr_init()
+ */
+int gr_perfctr_any_thread()
+{
+    return gr_perfctr_ops ? gr_perfctr_ops->any_thread : 0;
+}
+
+/*
+ * Number of events being monitored
+ */
+int gr_perfctr_num_events()
+{
+    return gr_num_events;
+}
+
+/*
+ * Name of the i-th monitored event
+ */
+const char *gr_perfctr_event_name(int i)
+{
+    return gr_event_names[i];
+}
+
+/*
+ * Event groups counting the i-th monitored event
+ */
+unsigned int gr_perfctr_event_groups(int i)
+{
+    unsigned int groups = 0;
+    int group, j;
+    for(group = 0; group < gr_num_groups; group ++) {
+        for(j = 0; j < gr_group_sizes[group]; j ++) {
+            if(gr_group_events[group][j] == i) {
+                groups |= 1u << group;
+            }
+        }
+    }
+    return groups;
+}
+
+/*
+ * Index of the monitored event with the given name
+ */
+int gr_perfctr_event_index(const char *name)
+{
+    int i;
+    for(i = 0; i < gr_num_events; i ++) {
+        if(!strcmp(gr_event_names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int gr_perfctr_role_by_name(const char *role_name)
+{
+    int role;
+    for(role = 0; role < GR_NUM_ROLES; role ++) {
+        if(!strcmp(gr_role_names[role], role_name)) {
+            return role;
+        }
+    }
+    return -1;
+}
+
+const char *gr_perfctr_role_name(int role)
+{
+    return gr_role_names[role];
+}
+
+/*
+ * Index of the monitored event with the given role
+ */
+int gr_perfctr_role_index(int role)
+{
+    return gr_event_roles[role];
+}
+
 /*
  * Print out performance counter results
  */
@@ -274,10 +669,10 @@ void gr_perfctr_print(FILE *log_file, gr_perfctr_t c, int phase_id)
         fprintf(log_file, "%d\t%d\t%s\t%lld\t%lld\t%lld\n",
             phase_id,
             c->count,
-            gr_PAPI_enames[i],
+            gr_event_names[i],
             c->max_values[i],
             c->min_values[i],
-            (c->count == 0)? 0:c->avg_values[i]/c->count
+            (c->event_count[i] == 0)? 0:c->avg_values[i]/c->event_count[i]
         );
     }
 }
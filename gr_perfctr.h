@@ -6,15 +6,53 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 
-#define NUM_EVENTS 4
+// most events monitored, over all event groups; gr_perfctr_num_events()
+// gives the number in use
+#define NUM_EVENTS 8
+
+/*
+ * Events in GR_PERFCTR_EVENTS are separated by ';' and event groups by '|'.
+ * The groups are counted in turn, see gr_perfctr_rotate().
+ */
+#define GR_PERFCTR_MAX_GROUPS 8
+
+/*
+ * Roles an event can play for derived metrics and scheduling policies.
+ * A role is tagged on an event in GR_PERFCTR_EVENTS as "EVENT@role", or
+ * inferred for well-known event names.
+ */
+
+#define GR_ROLE_CYCLES       0
+#define GR_ROLE_INSTRUCTIONS 1
+#define GR_ROLE_LLC_MISSES   2
+#define GR_ROLE_STALLS       3
+#define GR_ROLE_TASK_CLOCK   4 // CPU time in ns
+#define GR_ROLE_RUN_DELAY    5 // time in ns spent runnable but waiting for a CPU
+#define GR_NUM_ROLES         6
+
+/*
+ * Metrics derived from the events with roles. They are -1 where the events
+ * they need are not monitored or not counted.
+ */
+#define GR_METRIC_IPC       0 // instructions per cycle
+#define GR_METRIC_MPKI      1 // last level cache misses per 1000 instructions
+#define GR_METRIC_BANDWIDTH 2 // memory bandwidth from LLC misses, bytes per second
+#define GR_NUM_METRICS      3
+
+#define GR_LLC_LINE_SIZE 64 // bytes moved per last level cache miss
 
 typedef struct _gr_perfctr {
     long long count;
     long long start_values[NUM_EVENTS];
-    long long avg_values[NUM_EVENTS];
+    long long avg_values[NUM_EVENTS]; // sum over the occurrences in event_count
+    long long event_count[NUM_EVENTS]; // occurrences counted by each event's group
     long long min_values[NUM_EVENTS];
     long long max_values[NUM_EVENTS];
+    // running means of the metrics, over metric_count occurrences
+    double metrics[GR_NUM_METRICS];
+    long long metric_count[GR_NUM_METRICS];
 } gr_perfctr, *gr_perfctr_t;
 
 /*
@@ -42,6 +80,13 @@ int gr_perfctr_stop(int mpi_rank);
  */
 int gr_perfctr_is_on();
 
+/*
+ * Count an occurrence of an outermost phase, and move on to the next event
+ * group once the current one has counted GR_PERFCTR_ROTATE of them.
+ * Only call it between phases.
+ */
+int gr_perfctr_rotate(int mpi_rank);
+
 /*
  * Set the initial values for a performance counter handle.
  */
@@ -52,6 +97,19 @@ int gr_perfctr_init_counter(gr_perfctr_t counter);
  */
 int gr_perfctr_read(long long *values);
 
+/*
+ * Read performance counter values at a phase transition on the main thread,
+ * reusing the values of the last transition if they were read less than
+ * max_age ns before now. Return 1 if reused, 0 if read, or -1 for error.
+ */
+int gr_perfctr_snapshot(long long *values, uint64_t now, uint64_t max_age);
+
+/*
+ * Read performance counter values, or take those of the last transition if
+ * they are recent enough. Safe in a signal handler on the main thread.
+ */
+int gr_perfctr_read_recent(long long *values, uint64_t now, uint64_t max_age);
+
 /*
  * Read performance counter values at the start of a phase.
  */
@@ -67,6 +125,77 @@ int gr_perfctr_phase_end(gr_perfctr_t counter);
  */
 void gr_perfctr_update(gr_perfctr_t counter, long long *pctr_values);
 
+/*
+ * Compute the metrics of one interval from its counter values and its
+ * length in ns. Metrics that cannot be computed are set to -1.
+ */
+void gr_perfctr_compute_metrics(long long *pctr_values, uint64_t length, double *metrics);
+
+/*
+ * Add the metrics of one occurrence to the running means of the counter
+ */
+void gr_perfctr_update_metrics(gr_perfctr_t counter, long long *pctr_values, uint64_t length);
+
+/*
+ * Sum of the values of event i, scaled from the occurrences its group
+ * counted to all occurrences
+ */
+double gr_perfctr_scaled_sum(gr_perfctr_t counter, int i);
+
+/*
+ * Merge the statistics of counter src into counter dst
+ */
+void gr_perfctr_merge(gr_perfctr_t dst, gr_perfctr_t src);
+
+/*
+ * Name of the counter backend in use: "papi", "perf" or "sw"
+ */
+const char *gr_perfctr_backend_name();
+
+/*
+ * Non-zero if another thread can read the counters of the thread which
+ * initialized them (perf and sw backends)
+ */
+int gr_perfctr_any_thread();
+
+/*
+ * Number of events being monitored
+ */
+int gr_perfctr_num_events();
+
+/*
+ * Name of the i-th monitored event
+ */
+const char *gr_perfctr_event_name(int i);
+
+/*
+ * Event groups counting the i-th monitored event, one bit per group
+ */
+unsigned int gr_perfctr_event_groups(int i);
+
+/*
+ * Index of the monitored event with the given name, or -1 if that event is
+ * not monitored
+ */
+int gr_perfctr_event_index(const char *name);
+
+/*
+ * Role named "cycles", "instructions", "llc-misses", "stalls", "task-clock"
+ * or "run-delay", or -1 for an unknown name
+ */
+int gr_perfctr_role_by_name(const char *role_name);
+
+/*
+ * Name of a role
+ */
+const char *gr_perfctr_role_name(int role);
+
+/*
+ * Index of the monitored event with the given role, or -1 if no event has
+ * that role
+ */
+int gr_perfctr_role_index(int role);
+
 /*
  * Print out performance counter results
  */
@@ -0,0 +1,34 @@
+#ifndef _GR_PERFCTR_BACKEND_H_
+#define _GR_PERFCTR_BACKEND_H_
+/**
+ * Performance counter backends
+ *
+ * gr_perfctr.c parses the event names and forwards reads to one of these.
+ * Every event group is set up once, by init() in group order, and select()
+ * picks the group counted from the next start() on; it is only called while
+ * stopped. Values are counts of the selected group since the backend was
+ * started, one per event in the order its events were given.
+ */
+
+typedef struct _gr_perfctr_backend {
+    const char *name;
+    const char *default_events; // used if GR_PERFCTR_EVENTS is not set
+    int (*init)(int mpi_rank, int group, char **event_names, int num_events);
+    int (*select)(int mpi_rank, int group);
+    int (*finalize)(int mpi_rank); // of all groups set up, also after a failed init()
+    int (*start)(int mpi_rank);
+    int (*stop)(int mpi_rank);
+    int (*read)(long long *values);
+    int any_thread; // read() also works from threads other than the one that called init()
+} gr_perfctr_backend, *gr_perfctr_backend_t;
+
+#ifndef GR_NO_PAPI
+extern gr_perfctr_backend gr_perfctr_papi_backend;
+#endif
+
+#ifdef __linux__
+extern gr_perfctr_backend gr_perfctr_perf_backend;
+extern gr_perfctr_backend gr_perfctr_sw_backend;
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * PAPI performance counter backend
+ *
+ */
+#ifndef GR_NO_PAPI
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "papi.h"
+#include "gr_perfctr.h"
+#include "gr_perfctr_backend.h"
+
+// one event set per event group, created at init
+static int gr_PAPI_eventsets[GR_PERFCTR_MAX_GROUPS];
+static int gr_PAPI_num_eventsets = 0;
+static int gr_PAPI_eventset = PAPI_NULL; // of the selected group
+
+static int gr_papi_init(int mpi_rank, int group, char **event_names, int num_events)
+{
+    int rc;
+    if(group == 0) {
+        rc = PAPI_library_init(PAPI_VER_CURRENT);
+        if(rc != PAPI_VER_CURRENT) {
+            fprintf(stderr, "Error: rank %d PAPI error: %d %d:%s. %s:%d\n", 
+                mpi_rank, rc, PAPI_VER_CURRENT, PAPI_strerror(rc), __FILE__, __LINE__);
+            return -1;
+        }
+        gr_PAPI_num_eventsets = 0;
+    }
+ 
+    int eventset = PAPI_NULL;
+    rc = PAPI_create_eventset(&eventset); 
+    if(rc != PAPI_OK) {
+        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
+            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+        return -1;
+    }
+    gr_PAPI_eventsets[gr_PAPI_num_eventsets ++] = eventset;
+
+    int i;
+    for(i = 0; i < num_events; i ++) {
+        int event_code;
+        rc = PAPI_event_name_to_code(event_names[i], &event_code);    
+        if(rc != PAPI_OK) {
+            fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n",
+                mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+            return -1;
+        }
+        rc = PAPI_add_event(eventset, event_code);
+        if(rc != PAPI_OK) {
+            fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
+                mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int gr_papi_select(int mpi_rank, int group)
+{
+    gr_PAPI_eventset = gr_PAPI_eventsets[group];
+    return 0;
+}
+
+static int gr_papi_finalize(int mpi_rank)
+{
+    int i, ret = 0;
+    for(i = 0; i < gr_PAPI_num_eventsets; i ++) {
+        int rc = PAPI_cleanup_eventset(gr_PAPI_eventsets[i]);
+        if(rc == PAPI_OK) {
+            rc = PAPI_destroy_eventset(&gr_PAPI_eventsets[i]);
+        }
+        if(rc != PAPI_OK) {
+            fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
+                mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+            ret = -1;
+        }
+    }
+    gr_PAPI_num_eventsets = 0;
+    gr_PAPI_eventset = PAPI_NULL;
+    PAPI_shutdown();
+    return ret;
+}
+
+static int gr_papi_start(int mpi_rank)
+{
+    int rc = PAPI_start(gr_PAPI_eventset);
+    if(rc != PAPI_OK) {
+        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
+            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+static int gr_papi_stop(int mpi_rank)
+{
+    long long values[NUM_EVENTS];
+    int rc = PAPI_stop(gr_PAPI_eventset, values);
+    if(rc != PAPI_OK) {
+        fprintf(stderr, "Error: rank %d PAPI error: %s. %s:%d\n", 
+            mpi_rank, PAPI_strerror(rc), __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+static int gr_papi_read(long long *values)
+{
+    int rc = PAPI_read(gr_PAPI_eventset, values);
+    if(rc != PAPI_OK) {
+        fprintf(stderr, "Error: PAPI error: %s. %s:%d\n", 
+            PAPI_strerror(rc), __FILE__, __LINE__);
+        return -1;
+    }  
+    return 0;
+}
+
+gr_perfctr_backend gr_perfctr_papi_backend = {
+    "papi",
+    NULL,
+    gr_papi_init,
+    gr_papi_select,
+    gr_papi_finalize,
+    gr_papi_start,
+    gr_papi_stop,
+    gr_papi_read,
+    0 // event sets belong to a thread
+};
+
+#endif
@@ -0,0 +1,281 @@
+/**
+ * Linux perf_event_open() performance counter backend
+ *
+ * Each event group is opened as one perf group on the calling thread, with
+ * its leader disabled; start and stop enable and disable the selected one.
+ * Each event's page is mapped so the thread which opened them can read the
+ * counters with rdpmc, without a system call, when the kernel allows it.
+ * Otherwise, and from other threads, the group is read with read().
+ */
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "gr_perfctr.h"
+#include "gr_perfctr_backend.h"
+
+typedef struct _gr_perf_event_name {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} gr_perf_event_name;
+
+#define GR_PERF_CACHE(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+/*
+ * PAPI presets and perf names accepted in GR_PERFCTR_EVENTS. Raw events 
+ * are given as rNNNN, in hex. Software events are never read with rdpmc.
+ */
+static gr_perf_event_name gr_perf_event_names[] = {
+    {"PAPI_TOT_CYC", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"PAPI_TOT_INS", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"PAPI_REF_CYC", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"PAPI_BR_INS", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"PAPI_BR_MSP", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"PAPI_L3_TCA", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"PAPI_L3_TCM", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"PAPI_STL_ICY", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+    {"PAPI_RES_STL", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+    {"PAPI_L1_DCM", PERF_TYPE_HW_CACHE, GR_PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, 
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"PAPI_L1_ICM", PERF_TYPE_HW_CACHE, GR_PERF_CACHE(PERF_COUNT_HW_CACHE_L1I, 
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"PAPI_TLB_DM", PERF_TYPE_HW_CACHE, GR_PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, 
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"PAPI_TLB_IM", PERF_TYPE_HW_CACHE, GR_PERF_CACHE(PERF_COUNT_HW_CACHE_ITLB, 
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"stalled-cycles-frontend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+    {"stalled-cycles-backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {NULL, 0, 0}
+};
+
+static int gr_perf_group_fds[GR_PERFCTR_MAX_GROUPS][NUM_EVENTS];
+static struct perf_event_mmap_page *gr_perf_group_pages[GR_PERFCTR_MAX_GROUPS][NUM_EVENTS];
+static int gr_perf_group_sizes[GR_PERFCTR_MAX_GROUPS];
+static int gr_perf_num_groups = 0;
+static long gr_perf_page_size = 0;
+
+// the selected group
+static int *gr_perf_fds = gr_perf_group_fds[0];
+static struct perf_event_mmap_page **gr_perf_pages = gr_perf_group_pages[0];
+static int gr_perf_num_events = 0;
+
+// rdpmc only reads the counters of the calling thread
+static __thread int gr_perf_is_owner = 0;
+
+static int gr_perf_event_lookup(const char *name, uint32_t *type, uint64_t *config)
+{
+    int i;
+    for(i = 0; gr_perf_event_names[i].name; i ++) {
+        if(!strcmp(gr_perf_event_names[i].name, name)) {
+            *type = gr_perf_event_names[i].type;
+            *config = gr_perf_event_names[i].config;
+            return 0;
+        }
+    }
+    if(name[0] == 'r' && name[1] != '\0') {
+        char *end;
+        *config = strtoull(name + 1, &end, 16);
+        if(*end == '\0') {
+            *type = PERF_TYPE_RAW;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int gr_perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    return (int) syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static int gr_perf_finalize(int mpi_rank)
+{
+    int g, i;
+    for(g = 0; g < gr_perf_num_groups; g ++) {
+        for(i = 0; i < gr_perf_group_sizes[g]; i ++) {
+            if(gr_perf_group_pages[g][i]) {
+                munmap(gr_perf_group_pages[g][i], gr_perf_page_size);
+                gr_perf_group_pages[g][i] = NULL;
+            }
+            close(gr_perf_group_fds[g][i]);
+        }
+        gr_perf_group_sizes[g] = 0;
+    }
+    gr_perf_num_groups = 0;
+    gr_perf_num_events = 0;
+    return 0;
+}
+
+static int gr_perf_init(int mpi_rank, int group, char **event_names, int num_events)
+{
+    gr_perf_page_size = sysconf(_SC_PAGESIZE);
+    int *fds = gr_perf_group_fds[group];
+    gr_perf_group_sizes[group] = 0;
+    gr_perf_num_groups = group + 1;
+    int i;
+    for(i = 0; i < num_events; i ++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        uint32_t type;
+        uint64_t config;
+        if(gr_perf_event_lookup(event_names[i], &type, &config)) {
+            fprintf(stderr, "Error: rank %d unknown event %s. %s:%d\n",
+                mpi_rank, event_names[i], __FILE__, __LINE__);
+            return -1;
+        }
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = (i == 0); // the group follows its leader
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        int fd = gr_perf_event_open(&attr, (i == 0) ? -1 : fds[0]);
+        if(fd == -1) {
+            fprintf(stderr, "Error: rank %d perf_event_open(%s): %s. %s:%d\n",
+                mpi_rank, event_names[i], strerror(errno), __FILE__, __LINE__);
+            return -1;
+        }
+        fds[i] = fd;
+        gr_perf_group_sizes[group] ++;
+
+        // the page is only needed for rdpmc, read() works without it
+        void *page = mmap(NULL, gr_perf_page_size, PROT_READ, MAP_SHARED, fd, 0);
+        gr_perf_group_pages[group][i] = (page == MAP_FAILED) ? NULL : (struct perf_event_mmap_page *) page;
+    }
+    gr_perf_is_owner = 1;
+    return 0;
+}
+
+static int gr_perf_select(int mpi_rank, int group)
+{
+    gr_perf_fds = gr_perf_group_fds[group];
+    gr_perf_pages = gr_perf_group_pages[group];
+    gr_perf_num_events = gr_perf_group_sizes[group];
+    return 0;
+}
+
+static int gr_perf_start(int mpi_rank)
+{
+    if(gr_perf_num_events == 0) {
+        return 0;
+    }
+    if(ioctl(gr_perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) ||
+       ioctl(gr_perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+        fprintf(stderr, "Error: rank %d cannot start perf events: %s. %s:%d\n",
+            mpi_rank, strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+static int gr_perf_stop(int mpi_rank)
+{
+    if(gr_perf_num_events == 0) {
+        return 0;
+    }
+    if(ioctl(gr_perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP)) {
+        fprintf(stderr, "Error: rank %d cannot stop perf events: %s. %s:%d\n",
+            mpi_rank, strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t gr_rdpmc(uint32_t counter)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return (uint64_t) lo | ((uint64_t) hi << 32);
+}
+
+/*
+ * Read one counter from its mapped page, following the protocol in 
+ * linux/perf_event.h. Return -1 if the counter cannot be read this way
+ * right now, e.g. because it is not scheduled on the PMU.
+ */
+static inline int gr_perf_read_rdpmc(struct perf_event_mmap_page *pc, long long *value)
+{
+    uint32_t seq, idx;
+    uint64_t count;
+    do {
+        seq = pc->lock;
+        __asm__ __volatile__ ("" ::: "memory");
+        idx = pc->index;
+        count = pc->offset;
+        if(!pc->cap_user_rdpmc || idx == 0) {
+            return -1;
+        }
+        int64_t pmc = (int64_t) gr_rdpmc(idx - 1);
+        pmc <<= 64 - pc->pmc_width;
+        pmc >>= 64 - pc->pmc_width; // sign extend
+        count += pmc;
+        __asm__ __volatile__ ("" ::: "memory");
+    } while(pc->lock != seq);
+    *value = (long long) count;
+    return 0;
+}
+#endif
+
+static int gr_perf_read(long long *values)
+{
+    int i;
+#if defined(__x86_64__) || defined(__i386__)
+    if(gr_perf_is_owner) {
+        for(i = 0; i < gr_perf_num_events; i ++) {
+            if(!gr_perf_pages[i] || gr_perf_read_rdpmc(gr_perf_pages[i], &values[i])) {
+                break;
+            }
+        }
+        if(i == gr_perf_num_events) {
+            return 0;
+        }
+    }
+#endif
+    uint64_t buf[1 + NUM_EVENTS];
+    if(read(gr_perf_fds[0], buf, sizeof(buf)) < (ssize_t) ((1 + gr_perf_num_events) * sizeof(uint64_t))) {
+        fprintf(stderr, "Error: cannot read perf events: %s. %s:%d\n",
+            strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+    for(i = 0; i < gr_perf_num_events; i ++) {
+        values[i] = (long long) buf[1 + i];
+    }
+    return 0;
+}
+
+gr_perfctr_backend gr_perfctr_perf_backend = {
+    "perf",
+    NULL,
+    gr_perf_init,
+    gr_perf_select,
+    gr_perf_finalize,
+    gr_perf_start,
+    gr_perf_stop,
+    gr_perf_read,
+    1
+};
+
+#endif
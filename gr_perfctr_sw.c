@@ -0,0 +1,181 @@
+/**
+ * Software counter backend
+ *
+ * For nodes without PMU access. Counts come from the kernel's accounting
+ * of the thread which initialized the backend, and are readable from any
+ * thread:
+ *  task-clock        CPU time in ns, from its CPU-time clock
+ *  run-delay         time in ns spent runnable but waiting for a CPU, from
+ *                    its /proc schedstat
+ *  context-switches  voluntary and involuntary, process-wide, getrusage()
+ *  page-faults       minor and major, process-wide, getrusage()
+ * task-clock and run-delay play the roles of the same names, so the
+ * analytics finds them in the simulation's monitor buffer.
+ */
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "gr_perfctr.h"
+#include "gr_perfctr_backend.h"
+
+#define GR_SW_TASK_CLOCK 0
+#define GR_SW_RUN_DELAY 1
+#define GR_SW_CONTEXT_SWITCHES 2
+#define GR_SW_PAGE_FAULTS 3
+#define GR_SW_NUM_METRICS 4
+
+static const char *gr_sw_metric_names[GR_SW_NUM_METRICS] = {
+    "task-clock",
+    "run-delay",
+    "context-switches",
+    "page-faults"
+};
+
+static int gr_sw_group_metrics[GR_PERFCTR_MAX_GROUPS][NUM_EVENTS]; // metric of each event
+static int gr_sw_group_sizes[GR_PERFCTR_MAX_GROUPS];
+static int gr_sw_group_need_schedstat[GR_PERFCTR_MAX_GROUPS];
+static int gr_sw_group_need_rusage[GR_PERFCTR_MAX_GROUPS];
+
+// the selected group
+static int *gr_sw_metrics = gr_sw_group_metrics[0];
+static int gr_sw_num_events = 0;
+static int gr_sw_need_schedstat = 0;
+static int gr_sw_need_rusage = 0;
+
+static clockid_t gr_sw_cpu_clock;
+static int gr_sw_schedstat_fd = -1;
+static long long gr_sw_base[GR_SW_NUM_METRICS]; // values at start
+
+static long long gr_sw_read_schedstat_run_delay()
+{
+    // "<cpu time> <run delay> <timeslices>"
+    char buf[128];
+    ssize_t n = pread(gr_sw_schedstat_fd, buf, sizeof(buf) - 1, 0);
+    if(n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    char *p = strchr(buf, ' ');
+    return p ? strtoll(p + 1, NULL, 10) : 0;
+}
+
+static void gr_sw_read_all(long long *metrics)
+{
+    struct timespec ts;
+    clock_gettime(gr_sw_cpu_clock, &ts);
+    metrics[GR_SW_TASK_CLOCK] = (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    metrics[GR_SW_RUN_DELAY] = gr_sw_need_schedstat ? gr_sw_read_schedstat_run_delay() : 0;
+    if(gr_sw_need_rusage) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        metrics[GR_SW_CONTEXT_SWITCHES] = ru.ru_nvcsw + ru.ru_nivcsw;
+        metrics[GR_SW_PAGE_FAULTS] = ru.ru_minflt + ru.ru_majflt;
+    }
+    else {
+        metrics[GR_SW_CONTEXT_SWITCHES] = 0;
+        metrics[GR_SW_PAGE_FAULTS] = 0;
+    }
+}
+
+static int gr_sw_init(int mpi_rank, int group, char **event_names, int num_events)
+{
+    int i, m;
+    gr_sw_group_need_schedstat[group] = 0;
+    gr_sw_group_need_rusage[group] = 0;
+    for(i = 0; i < num_events; i ++) {
+        for(m = 0; m < GR_SW_NUM_METRICS; m ++) {
+            if(!strcmp(event_names[i], gr_sw_metric_names[m])) break;
+        }
+        if(m == GR_SW_NUM_METRICS) {
+            fprintf(stderr, "Error: rank %d unknown software event %s. %s:%d\n",
+                mpi_rank, event_names[i], __FILE__, __LINE__);
+            return -1;
+        }
+        gr_sw_group_metrics[group][i] = m;
+        if(m == GR_SW_RUN_DELAY) gr_sw_group_need_schedstat[group] = 1;
+        if(m == GR_SW_CONTEXT_SWITCHES || m == GR_SW_PAGE_FAULTS) gr_sw_group_need_rusage[group] = 1;
+    }
+    gr_sw_group_sizes[group] = num_events;
+
+    if(group == 0 && pthread_getcpuclockid(pthread_self(), &gr_sw_cpu_clock)) {
+        gr_sw_cpu_clock = CLOCK_THREAD_CPUTIME_ID;
+    }
+    if(gr_sw_group_need_schedstat[group] && gr_sw_schedstat_fd == -1) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%ld/schedstat", (long) syscall(SYS_gettid));
+        gr_sw_schedstat_fd = open(path, O_RDONLY);
+        if(gr_sw_schedstat_fd == -1) {
+            fprintf(stderr, "Error: rank %d cannot open %s: %s. %s:%d\n",
+                mpi_rank, path, strerror(errno), __FILE__, __LINE__);
+            return -1;
+        }
+    }
+    memset(gr_sw_base, 0, sizeof(gr_sw_base));
+    return 0;
+}
+
+static int gr_sw_select(int mpi_rank, int group)
+{
+    gr_sw_metrics = gr_sw_group_metrics[group];
+    gr_sw_num_events = gr_sw_group_sizes[group];
+    gr_sw_need_schedstat = gr_sw_group_need_schedstat[group];
+    gr_sw_need_rusage = gr_sw_group_need_rusage[group];
+    return 0;
+}
+
+static int gr_sw_finalize(int mpi_rank)
+{
+    if(gr_sw_schedstat_fd != -1) {
+        close(gr_sw_schedstat_fd);
+        gr_sw_schedstat_fd = -1;
+    }
+    gr_sw_num_events = 0;
+    return 0;
+}
+
+static int gr_sw_start(int mpi_rank)
+{
+    gr_sw_read_all(gr_sw_base);
+    return 0;
+}
+
+static int gr_sw_stop(int mpi_rank)
+{
+    return 0;
+}
+
+static int gr_sw_read(long long *values)
+{
+    long long metrics[GR_SW_NUM_METRICS];
+    gr_sw_read_all(metrics);
+    int i;
+    for(i = 0; i < gr_sw_num_events; i ++) {
+        int m = gr_sw_metrics[i];
+        values[i] = metrics[m] - gr_sw_base[m];
+    }
+    return 0;
+}
+
+gr_perfctr_backend gr_perfctr_sw_backend = {
+    "sw",
+    "task-clock@task-clock;run-delay@run-delay;context-switches;page-faults",
+    gr_sw_init,
+    gr_sw_select,
+    gr_sw_finalize,
+    gr_sw_start,
+    gr_sw_stop,
+    gr_sw_read,
+    1
+};
+
+#endif
@@ -1,120 +1,298 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <math.h>
 #include "goldrush.h"
 #include "gr_perfctr.h"
 #include "gr_phase.h"
+#include "gr_intern.h"
+#include "gr_summary.h"
 
-static int gr_num_phases = 0;
-static int gr_max_num_phases = 0;
-static gr_phase_t gr_phases = NULL;
-static gr_phase_perf_t gr_phases_perf = NULL;
+static int gr_default_num_phases = GR_DEFAULT_NUM_PHASES;
 
-static gr_file_array_t gr_files = NULL;
+// every thread which marks phases registers its context here. Slots are
+// claimed with an atomic increment and only read back at gr_finalize(),
+// after the threads are done, so no lock is needed.
+static gr_phase_ctx_t gr_phase_ctxs[GR_MAX_THREADS];
+static int gr_num_phase_ctxs = 0;
 
-// cache to speedup the search of gr_phases array
-static int previous_phase = -1; 
-static int current_phase = -1;
-static int new_phase = 1;
+static __thread gr_phase_ctx_t gr_my_phase_ctx = NULL;
 
 extern int gr_do_phase_perfctr;
+extern double gr_resume_quantile;
+extern int gr_adaptive_sampling;
+extern double gr_adaptive_rvar;
+extern uint32_t gr_adaptive_max_stride;
+extern uint32_t gr_adaptive_min_samples;
+extern double gr_adaptive_drift;
 extern int gr_num_events;
 extern int is_in_mainloop;
-extern int current_phase_id;
 
-int gr_open_file(char *filename) 
+static inline int compare_phase(gr_phase_t p,
+                                unsigned long int start_file,
+                                unsigned int start_line,
+                                unsigned long int end_file,
+                                unsigned int end_line
+                               )
 {
-    int i = 0;
-    if (!gr_files) {
-        fprintf(stderr, "gr_file is not initialized\n");
-        return -1;
-    }
-    
-    // check whether the file has been opened
-    for (i = 0; i < gr_files->size; i++) {
-        if (strcmp(filename, gr_files->names[i]) == 0) {
-            return gr_files->array[i];
+    return ((p->start_file_no == start_file) && 
+            (p->start_line_no == start_line) &&
+            (p->end_file_no == end_file) &&
+            (p->end_line_no == end_line));
+}
+
+static inline uint64_t gr_hash_mix(uint64_t h)
+{
+    // 64-bit finalizer of MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t gr_hash_start(unsigned long int file, unsigned int line)
+{
+    return gr_hash_mix((uint64_t) file * 0x9e3779b97f4a7c15ULL + line);
+}
+
+static inline uint64_t gr_hash_full(unsigned long int start_file,
+                                    unsigned int start_line,
+                                    unsigned long int end_file,
+                                    unsigned int end_line
+                                   )
+{
+    return gr_hash_mix(gr_hash_start(start_file, start_line) ^ 
+        ((uint64_t) end_file * 0xc2b2ae3d27d4eb4fULL + end_line));
+}
+
+/*
+ * Return the start index slot holding phases beginning at (file, line),
+ * or the empty slot where such a phase would go.
+ */
+static int gr_start_slot(gr_phase_ctx_t ctx, unsigned long int file, unsigned int line)
+{
+    int mask = ctx->index_size - 1;
+    int s = (int) (gr_hash_start(file, line) & mask);
+    while(ctx->start_index[s] != GR_PHASE_INDEX_EMPTY) {
+        gr_phase_t p = gr_phase_at(ctx, ctx->start_index[s]);
+        if(p->start_file_no == file && p->start_line_no == line) {
+            break;
         }
+        s = (s + 1) & mask;
     }
+    return s;
+}
 
-    // open the file and record the id
-    int fd = open(filename, O_RDWR);
-    if (fd == -1) {
-        fprintf(stderr, "open file error: %s\n", strerror(errno));
-        return -1;
+/*
+ * Return the full index slot holding the phase, or the empty slot where 
+ * it would go.
+ */
+static int gr_full_slot(gr_phase_ctx_t ctx,
+                        unsigned long int start_file,
+                        unsigned int start_line,
+                        unsigned long int end_file,
+                        unsigned int end_line
+                       )
+{
+    int mask = ctx->index_size - 1;
+    int s = (int) (gr_hash_full(start_file, start_line, end_file, end_line) & mask);
+    while(ctx->full_index[s] != GR_PHASE_INDEX_EMPTY) {
+        if(compare_phase(gr_phase_at(ctx, ctx->full_index[s]), start_file, start_line, end_file, end_line)) {
+            break;
+        }
+        s = (s + 1) & mask;
     }
-
-    gr_record_fd(fd, filename);
+    return s;
 }
 
-int gr_record_fd(int fd, char *filename)
+/*
+ * Add a phase to both indexes. For the start index, keep whichever phase
+ * beginning at the same place has the higher count.
+ */
+static void gr_index_phase(gr_phase_ctx_t ctx, int p_index)
 {
-    if (gr_files) {
-	   int next = gr_files->size;
-       strcpy(gr_files->names[next], filename);
-	   gr_files->array[next] = fd;
-	   gr_files->size++;
-     }
-
-     return 0;
+    gr_phase_t p = gr_phase_at(ctx, p_index);
+    int s = gr_full_slot(ctx, p->start_file_no, p->start_line_no, p->end_file_no, p->end_line_no);
+    ctx->full_index[s] = p_index;
+
+    s = gr_start_slot(ctx, p->start_file_no, p->start_line_no);
+    if(ctx->start_index[s] == GR_PHASE_INDEX_EMPTY ||
+       p->count > gr_phase_at(ctx, ctx->start_index[s])->count) {
+        ctx->start_index[s] = p_index;
+    }
 }
 
-int gr_create_global_phases(int max_num_phases)
+/*
+ * (Re)build both indexes with at least min_slots slots.
+ */
+static int gr_resize_phase_index(gr_phase_ctx_t ctx, int min_slots)
 {
-    gr_files = (gr_file_array_t) calloc (GR_MAX_OPEN_FILE, sizeof(gr_file_array));
-    if (!gr_files) {
-        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__ );
+    int size = 16;
+    while(size < min_slots) {
+        size <<= 1;
+    }
+    int *start_index = (int *) malloc(size * sizeof(int));
+    int *full_index = (int *) malloc(size * sizeof(int));
+    if(!start_index || !full_index) {
+        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+        free(start_index);
+        free(full_index);
         return -1;
     }
+    int i;
+    for(i = 0; i < size; i ++) {
+        start_index[i] = GR_PHASE_INDEX_EMPTY;
+        full_index[i] = GR_PHASE_INDEX_EMPTY;
+    }
+    if(ctx->start_index) free(ctx->start_index);
+    if(ctx->full_index) free(ctx->full_index);
+    ctx->start_index = start_index;
+    ctx->full_index = full_index;
+    ctx->index_size = size;
 
-    gr_files->size = 0;
-    memset(gr_files->array, -1, sizeof( GR_MAX_OPEN_FILE *sizeof(int) ) );
-
-    gr_phases = (gr_phase_t) calloc(GR_DEFAULT_NUM_PHASES, sizeof(gr_phase));
+    for(i = 0; i < ctx->num_phases; i ++) {
+        gr_index_phase(ctx, i);
+    }
+    return 0;
+}
 
-    if(!gr_phases) {
+/*
+ * Add a chunk to the phase store of ctx. Chunk k holds 
+ * 1 << (chunk_bits + k) phases, so the store grows geometrically while
+ * phases already stored never move.
+ */
+static int gr_add_phase_chunk(gr_phase_ctx_t ctx)
+{
+    int k = ctx->num_chunks;
+    if(k == GR_PHASE_MAX_CHUNKS) {
+        fprintf(stderr, "Error: too many phases. %s:%d\n", __FILE__, __LINE__);
+        return -1;
+    }
+    size_t n = (size_t) 1 << (ctx->chunk_bits + k);
+    gr_phase_t phases;
+    if(posix_memalign((void **) &phases, GR_CACHE_LINE_SIZE, n * sizeof(gr_phase))) {
         fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
         return -1;
     }
-    
-    gr_phases_perf = (gr_phase_perf_t) calloc(GR_DEFAULT_NUM_PHASES, sizeof(gr_phase_perf));
-    if(!gr_phases_perf) {
+    gr_phase_perf_t phases_perf;
+    if(posix_memalign((void **) &phases_perf, GR_CACHE_LINE_SIZE, n * sizeof(gr_phase_perf))) {
         fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+        free(phases);
         return -1;
     }
+    memset(phases, 0, n * sizeof(gr_phase));
+    memset(phases_perf, 0, n * sizeof(gr_phase_perf));
+    ctx->phases[k] = phases;
+    ctx->phases_perf[k] = phases_perf;
+    ctx->num_chunks ++;
+    ctx->max_num_phases += n;
+    return 0;
+}
+
+static void gr_destroy_phase_ctx(gr_phase_ctx_t ctx)
+{
+    int k;
+    for(k = 0; k < ctx->num_chunks; k ++) {
+        free(ctx->phases[k]);
+        free(ctx->phases_perf[k]);
+    }
+    free(ctx->start_index);
+    free(ctx->full_index);
+    free(ctx);
+}
+
+static gr_phase_ctx_t gr_create_phase_ctx(int max_num_phases)
+{
+    gr_phase_ctx_t ctx;
+    // contexts are written by different threads, keep them on separate 
+    // cache lines
+    if(posix_memalign((void **) &ctx, GR_CACHE_LINE_SIZE, sizeof(gr_phase_ctx))) {
+        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(gr_phase_ctx));
+
+    // the first chunk holds at least max_num_phases phases
+    ctx->chunk_bits = 4;
+    while((1 << ctx->chunk_bits) < max_num_phases) {
+        ctx->chunk_bits ++;
+    }
+    if(gr_add_phase_chunk(ctx)) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->num_phases = 0;
+    ctx->previous_phase = -1;
+    ctx->current_phase = -1;
     int i;
-    for(i = 0; i < gr_max_num_phases; i ++) {
-#ifdef GR_HAVE_PERFCTR
-        gr_perfctr_init_counter(&(gr_phases_perf[i].perf_counter));
-#endif
+    for(i = 0; i < GR_MAX_PHASE_DEPTH; i ++) {
+        ctx->last_phase[i] = -1;
     }
 
-    gr_max_num_phases = GR_DEFAULT_NUM_PHASES;
-    gr_num_phases = 0;
-    return 0;
+    if(gr_resize_phase_index(ctx, ctx->max_num_phases * 2)) {
+        gr_destroy_phase_ctx(ctx);
+        return NULL;
+    }
+    return ctx;
 }
 
-void gr_destroy_global_phases()
+/*
+ * Get the phase context of the calling thread, creating it on first use
+ */
+gr_phase_ctx_t gr_get_phase_ctx()
+{
+    if(gr_my_phase_ctx) {
+        return gr_my_phase_ctx;
+    }
+    gr_phase_ctx_t ctx = gr_create_phase_ctx(gr_default_num_phases);
+    if(!ctx) {
+        return NULL;
+    }
+    int slot = __sync_fetch_and_add(&gr_num_phase_ctxs, 1);
+    if(slot >= GR_MAX_THREADS) {
+        fprintf(stderr, "Error: more than %d threads mark phases. %s:%d\n", 
+            GR_MAX_THREADS, __FILE__, __LINE__);
+        gr_destroy_phase_ctx(ctx);
+        return NULL;
+    }
+    ctx->tid = slot;
+    gr_phase_ctxs[slot] = ctx;
+    gr_my_phase_ctx = ctx;
+    return ctx;
+}
+
+int gr_create_global_phases(int max_num_phases)
 {
-    if(gr_phases) free(gr_phases);
-    if(gr_phases_perf) free(gr_phases_perf);
+    gr_default_num_phases = max_num_phases;
+
+    // the calling (main) thread gets the first context, which the other
+    // threads are merged into at the end
+    if(!gr_get_phase_ctx()) {
+        return -1;
+    }
+    return 0;
 }
 
-void gr_destroy_opened_files()
+void gr_destroy_global_phases()
 {
     int i;
-    if (!gr_files)
-        return;
-    for (i = 0; i < gr_files->size; i++) {
-        close(gr_files->array[i]);
+    int n = gr_num_phase_ctxs < GR_MAX_THREADS ? gr_num_phase_ctxs : GR_MAX_THREADS;
+    for(i = 0; i < n; i ++) {
+        if(gr_phase_ctxs[i]) {
+            gr_destroy_phase_ctx(gr_phase_ctxs[i]);
+            gr_phase_ctxs[i] = NULL;
+        }
     }
-    free(gr_files);
-    return;
+    gr_num_phase_ctxs = 0;
+    gr_my_phase_ctx = NULL;
 }
 
 /*
@@ -125,201 +303,433 @@ gr_phase_t gr_find_phase(unsigned long int file, unsigned int line, gr_phase_per
     // we can only make a guess here. we need to avoid two bad things:
     // - allow a small region with high count      
     // - skip a large region with high count
-    // we use a simple scoring system to pick one: pick the most frequent one
-    int i;
-    float current_score = 0; 
-    gr_phase_t p = gr_phases;
-    new_phase = 1;
-    for(i = 0; i < gr_num_phases; i ++, p ++) {
-        if(file == p->start_file_no && line == p->start_line_no) {
-            // a candidate
-            float score = p->count;
-            if(score > current_score) {
-                current_phase = i;
-            }
-            new_phase = 0;
-        }
+    // we use a simple scoring system to pick one: pick the most frequent one,
+    // which is what the start index keeps for each start location
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    gr_phase_t p;
+    *phase_perf = NULL;
+    if(!ctx) {
+        return NULL;
     }
-    if(new_phase) { // first time we see this phase 
-        if(gr_num_phases == gr_max_num_phases) {
-            gr_max_num_phases ++;
-            gr_phases = (gr_phase_t) realloc(gr_phases,
-                sizeof(gr_phase) * gr_max_num_phases);
-            if(!gr_phases) {
-                fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
-                return NULL;
-            }
-            
-            gr_phases_perf = (gr_phase_perf_t) realloc(gr_phases_perf,
-                sizeof(gr_phase_perf) * gr_max_num_phases);
-            if(!gr_phases_perf) {
-                fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
-                return NULL;
-            }            
+
+    // test cache first
+    if(ctx->current_phase != -1) {
+        p = gr_phase_at(ctx, ctx->current_phase);
+        if(p->start_file_no == file && p->start_line_no == line) {
+            *phase_perf = gr_phase_perf_at(ctx, ctx->current_phase);
+            return p;
         }
-        gr_phases[gr_num_phases].start_file_no = file;  
-        gr_phases[gr_num_phases].start_line_no = line;  
-        current_phase = gr_num_phases;
     }
-    
-    *phase_perf = &(gr_phases_perf[current_phase]);
-    
-    current_phase_id = current_phase;
-    return &(gr_phases[current_phase]);
-} 
 
-static inline int compare_phase(gr_phase_t p,
-                                unsigned long int start_file,
-                                unsigned int start_line,
-                                unsigned long int end_file,
-                                unsigned int end_line
-                               )
-{
-    return ((p->start_file_no == start_file) && 
-            (p->start_line_no == start_line) &&
-            (p->end_file_no == end_file) &&
-            (p->end_line_no == end_line));
-}
+    int s = gr_start_slot(ctx, file, line);
+    if(ctx->start_index[s] == GR_PHASE_INDEX_EMPTY) { 
+        // first time we see this phase, gr_get_phase() will create it
+        ctx->current_phase = -1;
+        return NULL;
+    }
+    ctx->current_phase = ctx->start_index[s];
+    *phase_perf = gr_phase_perf_at(ctx, ctx->current_phase);
+    return gr_phase_at(ctx, ctx->current_phase);
+} 
 
 /*
- * Precisely find a phase or allocate one if not found
+ * Append a new phase to the phase table of ctx and index it
  */
-int gr_get_phase(unsigned long int start_file, 
-                 unsigned int start_line,
-                 unsigned long int end_file,
-                 unsigned int end_line 
-                )
+static int gr_new_phase(gr_phase_ctx_t ctx,
+                        unsigned long int start_file, 
+                        unsigned int start_line,
+                        unsigned long int end_file,
+                        unsigned int end_line 
+                       )
 {
-    gr_phase_t p;
-    gr_phase_perf_t pp;
-    // we already know this is the first time we see this phase
-    if(new_phase) {
-        p = &(gr_phases[gr_num_phases]);  
-        pp = &(gr_phases_perf[gr_num_phases]);      
-        p->end_file_no = end_file;
-        p->end_line_no = end_line;
-        p->count = 0;
-        pp->avg_length = 0;
-        pp->max_length = 0;
-        pp->min_length = 0;
-
-#ifdef GR_HAVE_PERFCTR
-        if(gr_do_phase_perfctr) {
-            gr_perfctr_init_counter(&(pp->perf_counter));
-        }
-#endif
-        previous_phase = gr_num_phases;
-        gr_num_phases ++; 
-        return previous_phase;
-    }
-
-    // test cache first
-    if((current_phase != -1) && 
-       compare_phase(&gr_phases[current_phase], start_file, start_line, end_file, end_line)) {
-        previous_phase = current_phase;
-        return previous_phase;
-    } 
-    
-    // scan the whole gr_phases array
-    // start from previous phase to exloit locality
-    int i = previous_phase;
-    while(i < gr_num_phases) {
-        if(compare_phase(&gr_phases[i], start_file, start_line, end_file, end_line)) {
-            previous_phase = i;
-            return i;
-        }
-        i ++;
-    }
-    // search from beginning to previous phase
-    i = 0;
-    while(i < previous_phase) {
-        if(compare_phase(&gr_phases[i], start_file, start_line, end_file, end_line)) {
-            previous_phase = i;
-            return i;
+    if(ctx->num_phases == ctx->max_num_phases) {
+        if(gr_add_phase_chunk(ctx)) {
+            return -1;
         }
-        i ++;
     }
-    // now we confirm it's a new phase
-    if(gr_num_phases == gr_max_num_phases) {
-        gr_max_num_phases ++;
-        gr_phases = (gr_phase_t) realloc(gr_phases,
-            sizeof(gr_phase) * gr_max_num_phases);
-        if(!gr_phases) {
-            fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+    // keep the load factor of the indexes at or below 1/2
+    if((ctx->num_phases + 1) * 2 > ctx->index_size) {
+        if(gr_resize_phase_index(ctx, ctx->index_size * 2)) {
             return -1;
         }
     }
-    p = &gr_phases[gr_num_phases];
-    pp = &(gr_phases_perf[gr_num_phases]); 
+
+    gr_phase_t p = gr_phase_at(ctx, ctx->num_phases);
+    gr_phase_perf_t pp = gr_phase_perf_at(ctx, ctx->num_phases); 
     p->start_file_no = start_file;
     p->start_line_no = start_line;
     p->end_line_no = end_line;
     p->end_file_no = end_file;
     p->count = 0;
-    pp->avg_length = 0;
-    pp->max_length = 0;
-    pp->min_length = 0;
+    p->sample_stride = 1;
+    p->skip = 0;
+    p->ew_mean = 0;
+    p->ew_var = 0;
+    p->drift_low = 0;
+    p->drift_high = UINT64_MAX;
+    p->resume_length = 0;
+    gr_stats_init(&(pp->length_stats));
+    pp->num_transitions = 0;
+    memset(pp->successors, 0, sizeof(pp->successors));
+    pp->profile_age = 0;
+    pp->profile_count = 0;
+    pp->overhead = 0;
+    pp->overhead_count = 0;
 
 #ifdef GR_HAVE_PERFCTR
     if(gr_do_phase_perfctr) {
         gr_perfctr_init_counter(&(pp->perf_counter));
     }
 #endif
-    previous_phase = gr_num_phases;
-    gr_num_phases ++;
-    return previous_phase;
+    gr_index_phase(ctx, ctx->num_phases);
+    return ctx->num_phases ++;
+}
+
+static int gr_ctx_get_phase(gr_phase_ctx_t ctx,
+                            unsigned long int start_file, 
+                            unsigned int start_line,
+                            unsigned long int end_file,
+                            unsigned int end_line 
+                           )
+{
+    // test cache first: the guess made by gr_find_phase(), then the phase
+    // ended last time
+    if((ctx->current_phase != -1) && 
+       compare_phase(gr_phase_at(ctx, ctx->current_phase), start_file, start_line, end_file, end_line)) {
+        ctx->previous_phase = ctx->current_phase;
+        return ctx->previous_phase;
+    } 
+    if((ctx->previous_phase != -1) && 
+       compare_phase(gr_phase_at(ctx, ctx->previous_phase), start_file, start_line, end_file, end_line)) {
+        return ctx->previous_phase;
+    } 
+    
+    int s = gr_full_slot(ctx, start_file, start_line, end_file, end_line);
+    if(ctx->full_index[s] != GR_PHASE_INDEX_EMPTY) {
+        ctx->previous_phase = ctx->full_index[s];
+        return ctx->previous_phase;
+    }
+
+    // now we confirm it's a new phase
+    int p_index = gr_new_phase(ctx, start_file, start_line, end_file, end_line);
+    if(p_index == -1) {
+        return -1;
+    }
+    ctx->previous_phase = p_index;
+    return ctx->previous_phase;
+}
+
+/*
+ * Precisely find a phase or allocate one if not found
+ */
+int gr_get_phase(unsigned long int start_file, 
+                 unsigned int start_line,
+                 unsigned long int end_file,
+                 unsigned int end_line 
+                )
+{
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    if(!ctx) {
+        return -1;
+    }
+    return gr_ctx_get_phase(ctx, start_file, start_line, end_file, end_line);
+}
+
+/*
+ * Keep the start index pointing at the most frequent phase of each start
+ * location.
+ */
+static inline void gr_update_start_index(gr_phase_ctx_t ctx, int p_index)
+{
+    gr_phase_t p = gr_phase_at(ctx, p_index);
+    int s = gr_start_slot(ctx, p->start_file_no, p->start_line_no);
+    if(ctx->start_index[s] != p_index && p->count > gr_phase_at(ctx, ctx->start_index[s])->count) {
+        ctx->start_index[s] = p_index;
+    }
+}
+
+/*
+ * Recompute the length used for the resume decision
+ */
+static inline void gr_refresh_resume_length(gr_phase_t p, gr_phase_perf_t pp)
+{
+    if(gr_resume_quantile < 0) {
+        p->resume_length = (uint64_t) pp->length_stats.mean;
+    }
+    else {
+        p->resume_length = gr_stats_quantile(&(pp->length_stats), gr_resume_quantile);
+    }
+}
+
+static inline void gr_update_ew_stats(gr_phase_t p, uint64_t length)
+{
+    float d = (float) length - p->ew_mean;
+    p->ew_mean += GR_ADAPTIVE_EW_WEIGHT * d;
+    p->ew_var = (1 - GR_ADAPTIVE_EW_WEIGHT) * (p->ew_var + GR_ADAPTIVE_EW_WEIGHT * d * d);
+}
+
+/*
+ * Adapt the sampling stride of a phase after a full measurement of the 
+ * given length: widen it while the phase is stable, narrow it on drift.
+ */
+static void gr_adapt_sampling(gr_phase_t p, gr_phase_perf_t pp, uint64_t length)
+{
+    if(pp->length_stats.count == 1) {
+        p->ew_mean = (float) length;
+    }
+    gr_update_ew_stats(p, length);
+    if(pp->length_stats.count < gr_adaptive_min_samples) {
+        return;
+    }
+    if(length < p->drift_low || length > p->drift_high) {
+        p->sample_stride = (p->sample_stride > 1) ? p->sample_stride / 2 : 1;
+    }
+    else if(p->ew_mean > 0 && 
+            p->ew_var / (p->ew_mean * p->ew_mean) < gr_adaptive_rvar &&
+            p->sample_stride < gr_adaptive_max_stride) {
+        p->sample_stride *= 2;
+    }
+    p->skip = p->sample_stride - 1;
+
+    float band = gr_adaptive_drift * sqrtf(p->ew_var);
+    p->drift_low = (p->ew_mean > band) ? (uint64_t) (p->ew_mean - band) : 0;
+    p->drift_high = (uint64_t) (p->ew_mean + band);
+}
+
+void gr_update_phase_fast(int p_index, uint64_t length)
+{
+    gr_phase_ctx_t ctx = gr_my_phase_ctx;
+    gr_phase_t p = gr_phase_at(ctx, p_index);
+    p->count ++;
+    if(length < p->drift_low || length > p->drift_high) {
+        // drift: keep the length and measure the next occurrences fully
+        gr_stats_update(&(gr_phase_perf_at(ctx, p_index)->length_stats), length);
+        gr_update_ew_stats(p, length);
+        p->sample_stride = (p->sample_stride > 1) ? p->sample_stride / 2 : 1;
+        p->skip = 0;
+    }
 }
 
 void gr_update_phase(int p_index, uint64_t length, long long *pctr_values)
 {
-    gr_phases[p_index].count ++;
-    gr_phase_perf_t pp = &gr_phases_perf[p_index];
+    gr_phase_ctx_t ctx = gr_my_phase_ctx;
+    gr_phase_t p = gr_phase_at(ctx, p_index);
+    p->count ++;
+    gr_phase_perf_t pp = gr_phase_perf_at(ctx, p_index);
 
 #if DEBUG_CHAO
-	fprintf(stdout, "index : %d, avg_length : %lu, count : %u, length: %lu\n", p_index, pp->avg_length, gr_phases[p_index].count, length);
+	fprintf(stdout, "index : %d, avg_length : %f, count : %u, length: %lu\n", p_index, pp->length_stats.mean, p->count, length);
 #endif
 
-    pp->avg_length = (pp->avg_length * gr_phases[p_index].count + length) / gr_phases[p_index].count;
-    //pp->avg_length += length;
-    if(length > pp->max_length) {
-        pp->max_length = length;
+    gr_stats_update(&(pp->length_stats), length);
+    // the mean is cheap, a quantile is refreshed every few samples only
+    if(gr_resume_quantile < 0 || p->count <= GR_RESUME_REFRESH || 
+       p->count % GR_RESUME_REFRESH == 0) {
+        gr_refresh_resume_length(p, pp);
     }
-    if(pp->min_length == 0 || length < pp->min_length) {
-        pp->min_length = length;
+
+    if(gr_adaptive_sampling) {
+        gr_adapt_sampling(p, pp, length);
     }
+
+    // this phase may have become the most frequent one at its start location
+    gr_update_start_index(ctx, p_index);
+
 #ifdef GR_HAVE_PERFCTR
 // optimized out
-    if(gr_do_phase_perfctr) {
-        if(is_in_mainloop) 
+    if(gr_do_phase_perfctr && pctr_values) {
+        if(is_in_mainloop) {
             gr_perfctr_update(&(pp->perf_counter), pctr_values);
+            gr_perfctr_update_metrics(&(pp->perf_counter), pctr_values, length);
+        }
+    }
+#endif
+}
+
+void gr_update_phase_overhead(int p_index, uint64_t overhead)
+{
+    gr_phase_perf_t pp = gr_phase_perf_at(gr_my_phase_ctx, p_index);
+    pp->overhead += overhead;
+    pp->overhead_count ++;
+}
+
+int gr_restore_phase(gr_phase_t p, gr_phase_perf_t pp)
+{
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    if(!ctx) {
+        return -1;
+    }
+    int p_index = gr_ctx_get_phase(ctx, p->start_file_no, p->start_line_no,
+                                   p->end_file_no, p->end_line_no);
+    if(p_index == -1) {
+        return -1;
+    }
+    gr_phase_t dp = gr_phase_at(ctx, p_index);
+    gr_phase_perf_t dpp = gr_phase_perf_at(ctx, p_index);
+    dp->count = p->count;
+    memcpy(&(dpp->length_stats), &(pp->length_stats), sizeof(gr_stats));
+    dpp->profile_age = pp->profile_age;
+    dpp->profile_count = pp->profile_count;
+#ifdef GR_HAVE_PERFCTR
+    memcpy(&(dpp->perf_counter), &(pp->perf_counter), sizeof(gr_perfctr));
+#endif
+    gr_refresh_resume_length(dp, dpp);
+    gr_update_start_index(ctx, p_index);
+    return p_index;
+}
+
+int gr_copy_main_phases()
+{
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    gr_phase_ctx_t src = gr_phase_ctxs[0];
+    if(!ctx || !src || ctx == src || ctx->num_phases != 0) {
+        return -1;
     }
+    int j;
+    for(j = 0; j < src->num_phases; j ++) {
+        gr_phase_t sp = gr_phase_at(src, j);
+        // appended at index j, so successor indices stay valid
+        int p_index = gr_new_phase(ctx, sp->start_file_no, sp->start_line_no,
+                                   sp->end_file_no, sp->end_line_no);
+        if(p_index == -1) {
+            return -1;
+        }
+        memcpy(gr_phase_at(ctx, p_index), sp, sizeof(gr_phase));
+        memcpy(gr_phase_perf_at(ctx, p_index), gr_phase_perf_at(src, j), sizeof(gr_phase_perf));
+        gr_update_start_index(ctx, p_index);
+    }
+    return src->num_phases;
+}
+
+void gr_return_main_phases(gr_phase_ctx_t ctx, int num_copied)
+{
+    gr_phase_ctx_t dst = gr_phase_ctxs[0];
+    int j;
+    for(j = 0; j < num_copied; j ++) {
+        gr_phase_t sp = gr_phase_at(ctx, j);
+        gr_phase_t dp = gr_phase_at(dst, j);
+        // counts only grow: the larger one went on recording after the copy
+        if(sp->count > dp->count) {
+            gr_phase_perf_t spp = gr_phase_perf_at(ctx, j);
+            gr_phase_perf_t dpp = gr_phase_perf_at(dst, j);
+            // successors refer to indices of their own table
+            spp->num_transitions = dpp->num_transitions;
+            memcpy(spp->successors, dpp->successors, sizeof(spp->successors));
+            memcpy(dp, sp, sizeof(gr_phase));
+            memcpy(dpp, spp, sizeof(gr_phase_perf));
+            gr_update_start_index(dst, j);
+        }
+        sp->count = 0; // left out of gr_merge_phases()
+    }
+}
+
+/*
+ * Merge the phase statistics of all other threads into the main thread's
+ * context. Called at finalize, once the other threads stopped marking phases.
+ * Successor tables refer to phase indexes of their own thread and are not
+ * merged.
+ */
+int gr_merge_phases()
+{
+    int n = gr_num_phase_ctxs < GR_MAX_THREADS ? gr_num_phase_ctxs : GR_MAX_THREADS;
+    if(n == 0) {
+        return 0;
+    }
+    gr_phase_ctx_t dst = gr_phase_ctxs[0];
+    int i, j;
+    for(i = 1; i < n; i ++) {
+        gr_phase_ctx_t src = gr_phase_ctxs[i];
+        if(!src) continue;
+        for(j = 0; j < src->num_phases; j ++) {
+            gr_phase_t sp = gr_phase_at(src, j);
+            gr_phase_perf_t spp = gr_phase_perf_at(src, j);
+            if(sp->count == 0) continue;
+            int d_index = gr_ctx_get_phase(dst, sp->start_file_no, sp->start_line_no,
+                                           sp->end_file_no, sp->end_line_no);
+            if(d_index == -1) {
+                return -1;
+            }
+            gr_phase_t dp = gr_phase_at(dst, d_index);
+            gr_phase_perf_t dpp = gr_phase_perf_at(dst, d_index);
+            gr_stats_merge(&(dpp->length_stats), &(spp->length_stats));
+            gr_refresh_resume_length(dp, dpp);
+            dp->count += sp->count;
+            dpp->overhead += spp->overhead;
+            dpp->overhead_count += spp->overhead_count;
+            gr_update_start_index(dst, d_index);
+#ifdef GR_HAVE_PERFCTR
+            if(gr_do_phase_perfctr) {
+                gr_perfctr_merge(&(dpp->perf_counter), &(spp->perf_counter));
+            }
 #endif
+        }
+    }
+    return 0;
 }
 
 void gr_print_phases(FILE *log_file)
 {
     int i;
-    for(i = 0; i < gr_num_phases; i ++) {
-        gr_phase_t p = &gr_phases[i];
-        gr_phase_perf_t pp = &gr_phases_perf[i];
+    gr_phase_ctx_t ctx = gr_phase_ctxs[0];
+    if(!ctx) {
+        return;
+    }
+    for(i = 0; i < ctx->num_phases; i ++) {
+        gr_phase_t p = gr_phase_at(ctx, i);
+        gr_phase_perf_t pp = gr_phase_perf_at(ctx, i);
 
-        fprintf(log_file, "%d\t%llu\t%llu\t%llu\t%d\t%d\t%d\t%d\n",
+        gr_stats_t ls = &(pp->length_stats);
+        fprintf(log_file, "%d\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%lu\t%d\t%lu\t%d\t%.0f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
             p->count,
-            pp->max_length,
-            pp->min_length,
-            (p->count == 0)? 0 : pp->avg_length/p->count,
+            ls->max,
+            ls->min,
+            (uint64_t) ls->mean,
             p->start_file_no,
             p->start_line_no,
             p->end_file_no,
-            p->end_line_no
+            p->end_line_no,
+            sqrt(gr_stats_variance(ls)),
+            gr_stats_quantile(ls, 0.1),
+            gr_stats_quantile(ls, 0.5),
+            gr_stats_quantile(ls, 0.9)
         );
     }
 #ifdef GR_HAVE_PERFCTR
     fprintf(log_file, "\nPerformance Counter\n");
-    for(i = 0; i < gr_num_phases; i ++) {
-        gr_phase_perf_t pp = &gr_phases_perf[i];
+    for(i = 0; i < ctx->num_phases; i ++) {
+        gr_phase_perf_t pp = gr_phase_perf_at(ctx, i);
         gr_perfctr_print(log_file, &(pp->perf_counter), i);
     }
 #endif
-}
 
+    // mean instrumentation overhead subtracted per measured occurrence
+    fprintf(log_file, "\nOverhead\n");
+    for(i = 0; i < ctx->num_phases; i ++) {
+        gr_phase_perf_t pp = gr_phase_perf_at(ctx, i);
+        fprintf(log_file, "%d\t%u\t%" PRIu64 "\n", i, pp->overhead_count,
+            (pp->overhead_count == 0) ? 0 : pp->overhead / pp->overhead_count);
+    }
+
+    // derived metrics of all phases, computed column-wise
+    gr_phase_summary summary;
+    memset(&summary, 0, sizeof(summary));
+    if(!gr_summary_build(&summary, ctx)) {
+        gr_summary_print(log_file, &summary);
+    }
+    gr_summary_free(&summary);
+
+    // names of interned file IDs
+    int has_names = 0;
+    for(i = 0; i < ctx->num_phases; i ++) {
+        gr_phase_t p = gr_phase_at(ctx, i);
+        const char *start_name = gr_intern_lookup(p->start_file_no);
+        const char *end_name = gr_intern_lookup(p->end_file_no);
+        if(!start_name && !end_name) continue;
+        if(!has_names) {
+            fprintf(log_file, "\nPhase Files\n");
+            has_names = 1;
+        }
+        fprintf(log_file, "%d\t%s\t%s\n", i, 
+            start_name ? start_name : "-", end_name ? end_name : "-");
+    }
+}
@@ -4,42 +4,165 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "gr_perfctr.h"
+#include "gr_stats.h"
 
 #define GR_DEFAULT_NUM_PHASES 256
-#define GR_MAX_OPEN_FILE 256
+#define GR_PHASE_INDEX_EMPTY -1
+#define GR_MAX_THREADS 256
+#define GR_CACHE_LINE_SIZE 64
+#define GR_MAX_PHASE_DEPTH 8
+#define GR_RESUME_REFRESH 16 // refresh the resume length every so many samples
+#define GR_ADAPTIVE_EW_WEIGHT 0.0625f // weight of a new sample in ew_mean/ew_var
 
-// used to store the opened file
-typedef struct _gr_file_array{
-    char names[GR_MAX_OPEN_FILE][64];
-    int array[GR_MAX_OPEN_FILE];
-    int size; 
-} gr_file_array, *gr_file_array_t;
 
+#define GR_ADAPTIVE_MAX_STRIDE_LIMIT 32768 // sample_stride is 16-bit
+#define GR_PHASE_MAX_CHUNKS 24
 
+/*
+ * The hot part of a phase: what every occurrence touches, kept on a single
+ * cache line. Length distributions and counter summaries, which only fully
+ * measured occurrences and reports touch, are kept in gr_phase_perf.
+ */
 typedef struct _gr_phase {
     uint64_t start_file_no;
     uint32_t start_line_no;
     uint32_t end_line_no;
     uint64_t end_file_no;
     uint32_t count;
-} gr_phase, *gr_phase_t;
+    // adaptive sampling: only every sample_stride-th occurrence is fully 
+    // measured, skip counts down the occurrences left before the next one.
+    // Stability is judged on exponentially weighted length statistics, so 
+    // the phase can settle again after a drift. An unmeasured length outside
+    // [drift_low, drift_high] means drift.
+    uint16_t sample_stride;
+    uint16_t skip;
+    // length the resume decision compares against GR_MIN_PHASE_LEN: the 
+    // mean, or the configured quantile of the length distribution
+    uint64_t resume_length;
+    float ew_mean;
+    float ew_var;
+    uint64_t drift_low;
+    uint64_t drift_high;
+} __attribute__((aligned(GR_CACHE_LINE_SIZE))) gr_phase, *gr_phase_t;
+
+#define GR_PREDICT_NUM_SUCCESSORS 4
+
+/*
+ * A phase observed to follow another one
+ */
+typedef struct _gr_phase_successor {
+    int phase_index;
+    uint32_t count;
+    double mean_gap; // time from the end of the phase to the start of this one
+} gr_phase_successor, *gr_phase_successor_t;
 
 typedef struct _gr_phase_perf {
-    uint64_t avg_length;
-    uint64_t max_length;
-    uint64_t min_length;
+    gr_stats length_stats; // one cache line, updated on every measurement
+    // most frequent successors, for the next-phase predictor
+    uint32_t num_transitions;
+    gr_phase_successor successors[GR_PREDICT_NUM_SUCCESSORS];
+    // runs since the phase was last seen and its count when loaded from 
+    // a phase profile
+    uint32_t profile_age;
+    uint32_t profile_count;
+    // instrumentation overhead subtracted from fully measured occurrences
+    uint64_t overhead;
+    uint32_t overhead_count;
 #ifdef GR_HAVE_PERFCTR
     gr_perfctr perf_counter;
 #endif
-} gr_phase_perf, *gr_phase_perf_t;
+} __attribute__((aligned(GR_CACHE_LINE_SIZE))) gr_phase_perf, *gr_phase_perf_t;
+
+/*
+ * An open phase
+ */
+typedef struct _gr_phase_frame {
+    unsigned long int file;
+    unsigned int line;
+    int phase_guess; // phase guessed by gr_find_phase() at the start
+    uint64_t start_time;
+    long long perfctr_values[NUM_EVENTS];
+    int perfctr_reused; // perfctr_values came from the last transition snapshot
+    int is_resumed;
+    int is_sampled; // fully measured, see adaptive sampling
+    // instrumentation overhead inside this phase: the stub handler time 
+    // when it started, and the cost of the nested phases' markers
+    uint64_t stub_time;
+    uint64_t child_overhead;
+    // idle window predicted at the start
+    uint64_t predicted_idle_length;
+    double predicted_confidence;
+} gr_phase_frame, *gr_phase_frame_t;
+
+/*
+ * Per-thread phase tracking context: the thread's own phase table, its 
+ * lookup cache and the phase it currently has open.
+ */
+typedef struct _gr_phase_ctx {
+    int tid;
+
+    // phase table and its hash indexes. Phases are stored in chunks which
+    // double in size, see gr_phase_at().
+    int num_phases;
+    int max_num_phases;
+    int chunk_bits; // log2 of the size of the first chunk
+    int num_chunks;
+    gr_phase_t phases[GR_PHASE_MAX_CHUNKS];
+    gr_phase_perf_t phases_perf[GR_PHASE_MAX_CHUNKS];
+    int *start_index;
+    int *full_index;
+    int index_size;
+
+    // cache to speedup the search of phases array
+    int previous_phase;
+    int current_phase;
+
+    // phases currently open on this thread, innermost on top. depth also
+    // counts phases nested deeper than GR_MAX_PHASE_DEPTH, which have no
+    // frame and are not tracked.
+    gr_phase_frame stack[GR_MAX_PHASE_DEPTH];
+    int depth;
+    int is_coop_task; // coopsched_init_task() done for this thread
+
+    // the phase ended last at each nesting depth, for the next-phase 
+    // predictor
+    int last_phase[GR_MAX_PHASE_DEPTH];
+    uint64_t last_phase_end_time[GR_MAX_PHASE_DEPTH];
+} gr_phase_ctx, *gr_phase_ctx_t;
+
+/*
+ * Locate phase p_index in the chunks of ctx. Chunk k starts at index
+ * ((1 << k) - 1) << chunk_bits.
+ */
+static inline int gr_phase_chunk(gr_phase_ctx_t ctx, int p_index, int *offset)
+{
+    unsigned int i = (unsigned int) p_index + (1u << ctx->chunk_bits);
+    int msb = 31 - __builtin_clz(i);
+    *offset = (int) (i - (1u << msb));
+    return msb - ctx->chunk_bits;
+}
+
+static inline gr_phase_t gr_phase_at(gr_phase_ctx_t ctx, int p_index)
+{
+    int offset;
+    int k = gr_phase_chunk(ctx, p_index, &offset);
+    return &ctx->phases[k][offset];
+}
+
+static inline gr_phase_perf_t gr_phase_perf_at(gr_phase_ctx_t ctx, int p_index)
+{
+    int offset;
+    int k = gr_phase_chunk(ctx, p_index, &offset);
+    return &ctx->phases_perf[k][offset];
+}
 
 int gr_create_global_phases(int max_num_phases);
-int gr_record_fd(int fd, char *filename);
 void gr_destroy_global_phases();
-void gr_destroy_opened_files();
 
 /*
- * Find the phase which match the start file and line number
+ * Find the phase which match the start file and line number. If several 
+ * phases start there, the most frequent one is returned. Return NULL if no
+ * phase starting there has been recorded yet.
  */
 gr_phase_t gr_find_phase(unsigned long int file, 
                          unsigned int line, 
@@ -55,11 +178,89 @@ int gr_get_phase(unsigned long int start_file,
                  unsigned int end_line 
                 );
 
+/*
+ * Push a frame for a phase being entered. Return NULL if phases are nested
+ * too deep; the phase is then not tracked.
+ */
+static inline gr_phase_frame_t gr_push_phase_frame(gr_phase_ctx_t ctx)
+{
+    int d = ctx->depth ++;
+    return (d < GR_MAX_PHASE_DEPTH) ? &ctx->stack[d] : NULL;
+}
+
+/*
+ * Pop the frame of the innermost open phase. Return NULL if that phase 
+ * was not tracked. The caller checks that a phase is open.
+ */
+static inline gr_phase_frame_t gr_pop_phase_frame(gr_phase_ctx_t ctx)
+{
+    int d = -- ctx->depth;
+    return (d < GR_MAX_PHASE_DEPTH) ? &ctx->stack[d] : NULL;
+}
+
+/*
+ * Insert a phase with previously recorded statistics (e.g. from a phase 
+ * profile) into the calling thread's phase table.
+ *
+ * Return the phase index, or -1 for error.
+ */
+int gr_restore_phase(gr_phase_t p, gr_phase_perf_t pp);
+
+/*
+ * Get the phase context of the calling thread, creating it on first use
+ */
+gr_phase_ctx_t gr_get_phase_ctx();
+
 void gr_update_phase(int p_index, uint64_t length, long long *pctr_values);
 
-void gr_print_phases(FILE *log_file);
+/*
+ * Record the instrumentation overhead subtracted from an occurrence
+ */
+void gr_update_phase_overhead(int p_index, uint64_t overhead);
+
+/*
+ * Decide whether the occurrence of phase p being entered is fully measured.
+ * Only every sample_stride-th occurrence is in adaptive sampling mode.
+ */
+static inline int gr_phase_is_sampled(gr_phase_t p)
+{
+    if(!p || p->skip == 0) {
+        return 1;
+    }
+    p->skip --;
+    return 0;
+}
 
-int gr_open_file(char *filename);
+/*
+ * Minimal update for an occurrence which was not fully measured: only count
+ * it, unless its length shows the phase drifted.
+ */
+void gr_update_phase_fast(int p_index, uint64_t length);
+
+/*
+ * Start the calling thread's phase table, which must be empty, as a copy of
+ * the main thread's, so the phases known so far have the same indices in
+ * both. The main thread must not mark phases meanwhile.
+ *
+ * Return the number of phases copied, or -1 for error.
+ */
+int gr_copy_main_phases();
+
+/*
+ * Hand the first num_copied phases of ctx, copied with gr_copy_main_phases(),
+ * back to the main thread: its table takes over those ctx recorded since,
+ * and gr_merge_phases() leaves them out. Called at finalize, once the
+ * thread of ctx stopped marking phases.
+ */
+void gr_return_main_phases(gr_phase_ctx_t ctx, int num_copied);
+
+/*
+ * Merge per-thread phase statistics into the main thread's phase table.
+ * Called at finalize, once the other threads stopped marking phases.
+ */
+int gr_merge_phases();
+
+void gr_print_phases(FILE *log_file);
 
 #endif
 
@@ -0,0 +1,85 @@
+/*
+ * A program to measure the per-marker cost of the phase table.
+ *
+ * It records a number of distinct phases and then replays gr_phase_start()/
+ * gr_phase_end() style lookups over them in a scattered order, so the
+ * previous_phase/current_phase cache does not hide the lookup cost.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "gr_phase.h"
+
+// normally defined in goldrush.c
+int gr_do_phase_perfctr = 0;
+int is_in_mainloop = 0;
+double gr_resume_quantile = -1;
+int gr_adaptive_sampling = 0;
+double gr_adaptive_rvar = 0;
+uint32_t gr_adaptive_max_stride = 1;
+uint32_t gr_adaptive_min_samples = 0;
+double gr_adaptive_drift = 0;
+
+int default_num_markers = 1000000;
+
+static uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double bench_phases(int num_phases, int num_markers)
+{
+    int i;
+    gr_phase_perf_t pp;
+    long long pctr_values[NUM_EVENTS];
+
+    if(gr_create_global_phases(GR_DEFAULT_NUM_PHASES)) {
+        exit(-1);
+    }
+
+    // populate the phase table, one phase per source line
+    for(i = 0; i < num_phases; i ++) {
+        gr_find_phase(1, 2*i, &pp);
+        int p_index = gr_get_phase(1, 2*i, 1, 2*i+1);
+        gr_update_phase(p_index, 1000, pctr_values);
+    }
+
+    // replay markers in a scattered order
+    unsigned int step = 7919; // a prime, so all phases get visited
+    unsigned int k = 0;
+    uint64_t start = bench_now();
+    for(i = 0; i < num_markers; i ++) {
+        k = (k + step) % num_phases;
+        gr_find_phase(1, 2*k, &pp);
+        int p_index = gr_get_phase(1, 2*k, 1, 2*k+1);
+        gr_update_phase(p_index, 1000, pctr_values);
+    }
+    uint64_t end = bench_now();
+
+    gr_destroy_global_phases();
+    return (double) (end - start) / num_markers;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_markers = default_num_markers;
+    if(argc == 2) {
+        num_markers = atoi(argv[1]);
+    }
+    else if(argc > 2) {
+        fprintf(stderr, "usage: %s [num_markers]\n", argv[0]);
+        exit(-1);
+    }
+
+    int num_phases[] = {10, 100, 1000, 10000};
+    int i;
+    fprintf(stdout, "phases\tns/marker\n");
+    for(i = 0; i < sizeof(num_phases)/sizeof(int); i ++) {
+        fprintf(stdout, "%d\t%.1f\n", num_phases[i], 
+            bench_phases(num_phases[i], num_markers));
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Next-phase predictor
+ *
+ */
+#include <stdint.h>
+#include "gr_phase.h"
+#include "gr_predict.h"
+
+extern uint64_t gr_predict_max_gap;
+extern double gr_predict_min_confidence;
+extern int gr_predict_depth;
+
+/*
+ * Count a transition from phase "from" to phase "to". Successor slots are 
+ * kept with the space-saving algorithm: an unseen successor takes over the
+ * least frequent slot.
+ */
+static void gr_predict_update(gr_phase_ctx_t ctx, int from, int to, uint64_t gap)
+{
+    gr_phase_perf_t pp = gr_phase_perf_at(ctx, from);
+    gr_phase_successor_t s = pp->successors;
+    gr_phase_successor_t victim = &s[0];
+    int i;
+
+    pp->num_transitions ++;
+    for(i = 0; i < GR_PREDICT_NUM_SUCCESSORS; i ++) {
+        if(s[i].count != 0 && s[i].phase_index == to) {
+            s[i].count ++;
+            s[i].mean_gap += ((double) gap - s[i].mean_gap) / s[i].count;
+            return;
+        }
+        if(s[i].count < victim->count) {
+            victim = &s[i];
+        }
+    }
+    victim->phase_index = to;
+    victim->count ++;
+    victim->mean_gap = (double) gap;
+}
+
+void gr_predict_phase_end(gr_phase_ctx_t ctx, 
+                          int depth, 
+                          int p_index, 
+                          uint64_t start_time, 
+                          uint64_t end_time
+                         )
+{
+    if(depth >= GR_MAX_PHASE_DEPTH) {
+        return;
+    }
+    if(ctx->last_phase[depth] != -1 && start_time >= ctx->last_phase_end_time[depth]) {
+        gr_predict_update(ctx, ctx->last_phase[depth], p_index, 
+            start_time - ctx->last_phase_end_time[depth]);
+    }
+    ctx->last_phase[depth] = p_index;
+    ctx->last_phase_end_time[depth] = end_time;
+}
+
+uint64_t gr_predict_idle_window(gr_phase_ctx_t ctx, int p_index, double *confidence)
+{
+    double conf = 1;
+    uint64_t window = gr_phase_at(ctx, p_index)->resume_length;
+    int cur = p_index;
+    int depth;
+
+    for(depth = 0; depth < gr_predict_depth; depth ++) {
+        gr_phase_perf_t pp = gr_phase_perf_at(ctx, cur);
+        if(pp->num_transitions == 0) {
+            break;
+        }
+        gr_phase_successor_t best = &pp->successors[0];
+        int i;
+        for(i = 1; i < GR_PREDICT_NUM_SUCCESSORS; i ++) {
+            if(pp->successors[i].count > best->count) {
+                best = &pp->successors[i];
+            }
+        }
+        double prob = (double) best->count / pp->num_transitions;
+        if(conf * prob < gr_predict_min_confidence || best->mean_gap > gr_predict_max_gap) {
+            break;
+        }
+        conf *= prob;
+        cur = best->phase_index;
+        window += (uint64_t) best->mean_gap + gr_phase_at(ctx, cur)->resume_length;
+    }
+    *confidence = conf;
+    return window;
+}
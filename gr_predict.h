@@ -0,0 +1,38 @@
+#ifndef _GR_PREDICT_H_
+#define _GR_PREDICT_H_
+/**
+ * Next-phase predictor
+ *
+ * An online Markov model over the phases of a thread: for each phase we keep
+ * its most frequent successors and the gap before them. Following the most
+ * likely successors tells how long the idle window starting with a phase is
+ * going to be once back-to-back phases are merged.
+ */
+#include <stdint.h>
+#include "gr_phase.h"
+
+#define GR_PREDICT_MAX_DEPTH 8
+
+/*
+ * Record that phase p_index ran from start_time to end_time at nesting 
+ * depth on the thread owning ctx. Called at the end of every phase. 
+ * Transitions are only counted between phases at the same depth, so inner
+ * idle windows are predicted separately from outer ones.
+ */
+void gr_predict_phase_end(gr_phase_ctx_t ctx, 
+                          int depth, 
+                          int p_index, 
+                          uint64_t start_time, 
+                          uint64_t end_time
+                         );
+
+/*
+ * Predict the length of the idle window starting with phase p_index: the
+ * phase itself plus the likely successors following it within the merge gap.
+ *
+ * Return the predicted length and set *confidence to the probability of the
+ * successor chain that was merged (1 if no successor was merged).
+ */
+uint64_t gr_predict_idle_window(gr_phase_ctx_t ctx, int p_index, double *confidence);
+
+#endif
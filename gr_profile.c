@@ -0,0 +1,198 @@
+/**
+ * Persistent phase profiles
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "gr_perfctr.h"
+#include "gr_phase.h"
+#include "gr_profile.h"
+
+static void gr_profile_file_name(char *buf, int size, char *path, int rank)
+{
+    snprintf(buf, size, "%s.%d", path, rank);
+}
+
+#ifdef GR_HAVE_PERFCTR
+/*
+ * Non-zero if the profile was written monitoring the events of this run, in
+ * the same order and groups. A name too long for the header never matches.
+ */
+static int gr_profile_same_events(gr_profile_header_t h)
+{
+    int n = gr_perfctr_num_events();
+    if(h->num_events != (uint32_t) n) {
+        return 0;
+    }
+    int i;
+    for(i = 0; i < n; i ++) {
+        const char *name = gr_perfctr_event_name(i);
+        if(strlen(name) >= GR_PROFILE_EVENT_NAME_LEN ||
+           strncmp(h->event_names[i], name, GR_PROFILE_EVENT_NAME_LEN) ||
+           h->event_groups[i] != gr_perfctr_event_groups(i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+int gr_profile_load(char *path, int rank, int max_age)
+{
+    char file_name[256];
+    gr_profile_file_name(file_name, sizeof(file_name), path, rank);
+
+    int fd = open(file_name, O_RDONLY);
+    if(fd == -1) {
+        if(errno != ENOENT) {
+            fprintf(stderr, "Error: cannot open phase profile %s: %s. %s:%d\n",
+                file_name, strerror(errno), __FILE__, __LINE__);
+            return -1;
+        }
+        return 0; // first run
+    }
+    struct stat st;
+    if(fstat(fd, &st) || (size_t) st.st_size < sizeof(gr_profile_header)) {
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map phase profile %s: %s. %s:%d\n",
+            file_name, strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+
+    gr_profile_header_t h = (gr_profile_header_t) addr;
+    if(h->magic != GR_PROFILE_MAGIC || h->version != GR_PROFILE_VERSION ||
+       h->entry_size != sizeof(gr_profile_entry) ||
+       sizeof(gr_profile_header) + h->num_entries * sizeof(gr_profile_entry) > (uint64_t) st.st_size) {
+        fprintf(stderr, "Warning: ignore incompatible phase profile %s.\n", file_name);
+        munmap(addr, st.st_size);
+        return 0;
+    }
+#ifdef GR_HAVE_PERFCTR
+    // sums of other events would be taken for those of this run
+    int same_events = gr_profile_same_events(h);
+    if(!same_events) {
+        fprintf(stderr, "Warning: ignore counters of phase profile %s, written with other events.\n", file_name);
+    }
+#endif
+
+    gr_profile_entry_t e = (gr_profile_entry_t) (h + 1);
+    int num_loaded = 0;
+    uint64_t i;
+    for(i = 0; i < h->num_entries; i ++, e ++) {
+        if((int) e->age >= max_age) {
+            continue; // stale
+        }
+        gr_phase p;
+        gr_phase_perf pp;
+        memset(&pp, 0, sizeof(pp));
+        p.start_file_no = e->start_file_no;
+        p.start_line_no = e->start_line_no;
+        p.end_file_no = e->end_file_no;
+        p.end_line_no = e->end_line_no;
+        p.count = e->count;
+        memcpy(&pp.length_stats, &e->length_stats, sizeof(gr_stats));
+        // stays stale unless the phase shows up again in this run
+        pp.profile_age = e->age + 1;
+        pp.profile_count = e->count;
+#ifdef GR_HAVE_PERFCTR
+        if(same_events) {
+            memcpy(&pp.perf_counter, &e->perf_counter, sizeof(gr_perfctr));
+        }
+        else {
+            gr_perfctr_init_counter(&pp.perf_counter);
+        }
+#endif
+        if(gr_restore_phase(&p, &pp) == -1) {
+            munmap(addr, st.st_size);
+            return -1;
+        }
+        num_loaded ++;
+    }
+    munmap(addr, st.st_size);
+    return num_loaded;
+}
+
+int gr_profile_save(char *path, int rank)
+{
+    char file_name[256];
+    gr_profile_file_name(file_name, sizeof(file_name), path, rank);
+
+    gr_phase_ctx_t ctx = gr_get_phase_ctx();
+    if(!ctx) {
+        return -1;
+    }
+    uint64_t num_entries = 0;
+    int i;
+    for(i = 0; i < ctx->num_phases; i ++) {
+        if(gr_phase_at(ctx, i)->count) num_entries ++;
+    }
+
+    size_t size = sizeof(gr_profile_header) + num_entries * sizeof(gr_profile_entry);
+    int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        fprintf(stderr, "Error: cannot open phase profile %s: %s. %s:%d\n",
+            file_name, strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+    if(ftruncate(fd, size)) {
+        fprintf(stderr, "Error: cannot resize phase profile %s: %s. %s:%d\n",
+            file_name, strerror(errno), __FILE__, __LINE__);
+        close(fd);
+        return -1;
+    }
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map phase profile %s: %s. %s:%d\n",
+            file_name, strerror(errno), __FILE__, __LINE__);
+        return -1;
+    }
+
+    gr_profile_entry_t e = (gr_profile_entry_t) ((gr_profile_header_t) addr + 1);
+    for(i = 0; i < ctx->num_phases; i ++) {
+        gr_phase_t p = gr_phase_at(ctx, i);
+        gr_phase_perf_t pp = gr_phase_perf_at(ctx, i);
+        if(p->count == 0) continue;
+        memset(e, 0, sizeof(gr_profile_entry));
+        e->start_file_no = p->start_file_no;
+        e->start_line_no = p->start_line_no;
+        e->end_file_no = p->end_file_no;
+        e->end_line_no = p->end_line_no;
+        e->count = p->count;
+        e->age = (p->count > pp->profile_count) ? 0 : pp->profile_age;
+        memcpy(&e->length_stats, &pp->length_stats, sizeof(gr_stats));
+#ifdef GR_HAVE_PERFCTR
+        memcpy(&e->perf_counter, &pp->perf_counter, sizeof(gr_perfctr));
+#endif
+        e ++;
+    }
+
+    // write the header last, so a partly written profile is never valid
+    gr_profile_header_t h = (gr_profile_header_t) addr;
+    h->version = GR_PROFILE_VERSION;
+    h->entry_size = sizeof(gr_profile_entry);
+    h->num_events = gr_perfctr_num_events();
+    h->num_entries = num_entries;
+    for(i = 0; i < (int) h->num_events; i ++) {
+        strncpy(h->event_names[i], gr_perfctr_event_name(i), GR_PROFILE_EVENT_NAME_LEN - 1);
+        h->event_groups[i] = gr_perfctr_event_groups(i);
+    }
+    msync(addr, size, MS_SYNC);
+    h->magic = GR_PROFILE_MAGIC;
+    msync(addr, size, MS_SYNC);
+    munmap(addr, size);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef _GR_PROFILE_H_
+#define _GR_PROFILE_H_
+/**
+ * Persistent phase profiles
+ *
+ * A phase profile file keeps the phase table of a process across runs so a
+ * restarted job does not have to see every phase once before it can resume
+ * analytics. The file is a header followed by an array of fixed size 
+ * entries and is accessed with mmap().
+ */
+#include <stdint.h>
+#include "gr_stats.h"
+#include "gr_perfctr.h"
+
+#define GR_PROFILE_MAGIC 0x46525047 // "GPRF"
+#define GR_PROFILE_VERSION 5 // 2: lengths in ns, 3: per-event counts, 4: metrics, 5: event names
+#define GR_PROFILE_EVENT_NAME_LEN 64
+#define GR_PROFILE_DEFAULT_MAX_AGE 5
+
+typedef struct _gr_profile_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t num_events;
+    uint64_t num_entries;
+    // the counter summaries of the entries are only used if the same events
+    // are monitored, in the same groups
+    char event_names[NUM_EVENTS][GR_PROFILE_EVENT_NAME_LEN];
+    uint32_t event_groups[NUM_EVENTS];
+} gr_profile_header, *gr_profile_header_t;
+
+typedef struct _gr_profile_entry {
+    uint64_t start_file_no;
+    uint64_t end_file_no;
+    uint32_t start_line_no;
+    uint32_t end_line_no;
+    uint32_t count;
+    uint32_t age; // number of runs since the phase was last seen
+    gr_stats length_stats;
+#ifdef GR_HAVE_PERFCTR
+    gr_perfctr perf_counter;
+#endif
+} gr_profile_entry, *gr_profile_entry_t;
+
+/*
+ * Load the phase profile of this rank into the calling thread's phase table.
+ * Entries not seen for max_age runs are dropped.
+ *
+ * Return the number of phases loaded, or -1 for error.
+ */
+int gr_profile_load(char *path, int rank, int max_age);
+
+/*
+ * Write the calling thread's phase table to the phase profile of this rank.
+ *
+ * Return 0 for success and -1 for error.
+ */
+int gr_profile_save(char *path, int rank);
+
+#endif
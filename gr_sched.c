@@ -9,15 +9,18 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <limits.h>
+#include <dlfcn.h>
 #include "df_shm.h"
 #include "gr_monitor_buffer.h"
+#include "gr_node_monitor.h"
 #include "gr_perfctr.h"
 #include "gr_sched.h"
+#include "gr_sched_plugin.h"
 #include "gr_internal.h"
 
 // Global variables
 int scheduling_interval_us = GR_DEFAULT_SCHEDULING_INTERVAL;
-int num_read_lock_tries = 10;
 volatile sig_atomic_t disable_scheduler = 0;
 struct sigaction old_sa;
 gr_scheduler gr_global_scheduler = {
@@ -37,6 +40,8 @@ perf_window_t self_perf_windows = NULL;
 int self_perf_window_size = GR_SCHEDULING_WINDOW_SIZE;
 int self_perf_window_idx = 0;
 
+uint64_t sim_next_sample = 0; // samples of the simulation seen so far
+
 long long pctr_v1[NUM_EVENTS];
 long long pctr_v2[NUM_EVENTS];
 long long *cur_perfctr, *old_perfctr;
@@ -44,6 +49,8 @@ long long *cur_perfctr, *old_perfctr;
 extern df_shm_method_t gr_shm_handle;
 extern df_shm_region_t gr_mon_buffer_region;
 extern gr_mon_buffer_t gr_monitor_buffer;
+extern df_shm_region_t gr_node_monitor_region;
+extern gr_node_mon_t gr_node_monitor;
 extern int gr_local_rank;
 extern int gr_local_size;
 extern int gr_comm_rank;
@@ -57,6 +64,17 @@ typedef struct _contenion_sched_param {
     double ipc_threshold;
     double l2_miss_threshold;
     double sleep_duration;
+    // if the simulation publishes task-clock and run-delay (software
+    // counters): back off when it spends more than this fraction of its time
+    // waiting for a CPU
+    double run_delay_threshold;
+    // back off when all simulation ranks on the node together use more
+    // than this many bytes per second of memory bandwidth; 0 if not used
+    double node_bandwidth_threshold;
+    // this process's events by role; the simulation's come from its monitor buffer
+    int self_cycles_event;
+    int self_llc_misses_event;
+    int warned; // that the events cannot tell contention
 } contention_sched_param, *contention_sched_param_t;
 
 int gr_contention_sched_init(void *client_data);
@@ -113,6 +131,63 @@ int gr_delay_usec(int usec)
     return 0;
 }
 
+/*
+ * Value of the event with the given index in a window, 0 if the event is
+ * not monitored
+ */
+static inline long long gr_window_value(perf_window_t window, int event_index)
+{
+    return (event_index == -1) ? 0 : window->pctr_values[event_index];
+}
+
+/*
+ * Sum up the samples in the monitor buffer since the last call into window.
+ * A metric covers only the samples which could compute it, so the rates
+ * are exact over those samples even if the simulation rotates its events.
+ *
+ * Return the phase of the latest sample, or -1 if there is no new sample.
+ */
+static int gr_fold_samples(perf_window_t window)
+{
+    int num_events = gr_monitor_buffer->num_events;
+    int cyc = gr_monitor_buffer->roles[GR_ROLE_CYCLES];
+    int ins = gr_monitor_buffer->roles[GR_ROLE_INSTRUCTIONS];
+    int miss = gr_monitor_buffer->roles[GR_ROLE_LLC_MISSES];
+    double ipc_cyc = 0, ipc_ins = 0, mpki_ins = 0, mpki_miss = 0, bw_time = 0, bw_miss = 0;
+    int phase_id = -1;
+    int j;
+
+    memset(window->pctr_values, 0, sizeof(long long)*num_events);
+    window->interval = 0;
+    gr_mon_sample sample;
+    while(gr_read_samples(gr_monitor_buffer, &sim_next_sample, &sample, 1) == 1) {
+        phase_id = sample.phase_id;
+        window->phase_id = sample.phase_id;
+        window->timestamp = sample.timestamp;
+        window->interval += sample.interval;
+        for(j = 0; j < num_events; j ++) {
+            window->pctr_values[j] += sample.perfctr_values[j];
+        }
+        if(sample.metrics[GR_METRIC_IPC] >= 0) {
+            ipc_cyc += sample.perfctr_values[cyc];
+            ipc_ins += sample.perfctr_values[ins];
+        }
+        if(sample.metrics[GR_METRIC_MPKI] >= 0) {
+            mpki_ins += sample.perfctr_values[ins];
+            mpki_miss += sample.perfctr_values[miss];
+        }
+        if(sample.metrics[GR_METRIC_BANDWIDTH] >= 0) {
+            bw_time += sample.interval;
+            bw_miss += sample.perfctr_values[miss];
+        }
+    }
+    window->metrics[GR_METRIC_IPC] = (ipc_cyc > 0) ? ipc_ins / ipc_cyc : -1;
+    window->metrics[GR_METRIC_MPKI] = (mpki_ins > 0) ? mpki_miss * 1000 / mpki_ins : -1;
+    window->metrics[GR_METRIC_BANDWIDTH] = (bw_time > 0) ? 
+        bw_miss * GR_LLC_LINE_SIZE * 1e9 / bw_time : -1;
+    return phase_id;
+}
+
 void gr_timer_sched_handler(int signum)
 {
     if(disable_scheduler) {
@@ -123,7 +198,8 @@ void gr_timer_sched_handler(int signum)
     // get performance data of this process
     gr_perfctr_read(cur_perfctr);
     long long *window = self_perf_windows[self_perf_window_idx].pctr_values;
-    for(i = 0; i < NUM_EVENTS; i ++) {
+    int num_events = gr_perfctr_num_events();
+    for(i = 0; i < num_events; i ++) {
         window[i] = cur_perfctr[i] - old_perfctr[i];
     }
     self_perf_window_idx = (self_perf_window_idx+1) % self_perf_window_size;
@@ -131,31 +207,15 @@ void gr_timer_sched_handler(int signum)
     cur_perfctr = old_perfctr;
     old_perfctr = temp_p;
 
-    int rc = 0;
-    int phase_id = 0;
-    // read performance counters from monitor buffer
-    // try to lock monitor buffer
-    for(i = 0; i < num_read_lock_tries; i ++) {
-        rc = pthread_rwlock_tryrdlock(&gr_monitor_buffer->rwlock);
-        if(rc == 0) {
-            // have locked monitor buffer
-            phase_id = gr_monitor_buffer->phase_id;
-            int j;
-            long long *dest = perf_windows[perf_window_idx].pctr_values;
-            long long *src = gr_monitor_buffer->perfctr_values;
-            perf_windows[perf_window_idx].phase_id = perf_windows[perf_window_idx].phase_id;
-            for(j = 0; j < NUM_EVENTS; j ++) {
-                dest[j] = src[j];
-            }              
-            perf_window_idx = (perf_window_idx+1) % perf_window_size;
-
-            pthread_rwlock_unlock(&gr_monitor_buffer->rwlock);
-            break;
-        }
+    // fold every sample the simulation took since the last tick into one
+    // window, read from its monitor buffer without locking
+    int phase_id = gr_fold_samples(&perf_windows[perf_window_idx]);
+    if(phase_id != -1) {
+        perf_window_idx = (perf_window_idx+1) % perf_window_size;
     }
 
     // invoke scheduler function
-    rc = (*gr_global_scheduler.sched_func) (NULL);
+    int rc = (*gr_global_scheduler.sched_func) (gr_global_scheduler.client_data);
 
     if(rc == 0) {
         // let analytics running
@@ -176,11 +236,17 @@ void gr_timer_sched_handler(int signum)
     }
 
     sched_traces[sched_trace_idx].phase_id = phase_id;
-    sched_traces[sched_trace_idx].timestamp = rdtsc();
-    sched_traces[sched_trace_idx].sim_cycle = perf_windows[perf_window_idx-1].pctr_values[0]; 
-    sched_traces[sched_trace_idx].sim_inst = perf_windows[perf_window_idx-1].pctr_values[1];
-    sched_traces[sched_trace_idx].l2_miss = self_perf_windows[self_perf_window_idx-1].pctr_values[2]; 
-    sched_traces[sched_trace_idx].analysis_cycle = self_perf_windows[self_perf_window_idx-1].pctr_values[0];
+    sched_traces[sched_trace_idx].timestamp = gr_clock_ns();
+    int w = (perf_window_idx + perf_window_size - 1) % perf_window_size;
+    int self_w = (self_perf_window_idx + self_perf_window_size - 1) % self_perf_window_size;
+    sched_traces[sched_trace_idx].sim_cycle = gr_window_value(&perf_windows[w],
+        gr_mon_buffer_role_index(gr_monitor_buffer, "cycles"));
+    sched_traces[sched_trace_idx].sim_inst = gr_window_value(&perf_windows[w],
+        gr_mon_buffer_role_index(gr_monitor_buffer, "instructions"));
+    sched_traces[sched_trace_idx].l2_miss = gr_window_value(&self_perf_windows[self_w],
+        gr_perfctr_role_index(GR_ROLE_LLC_MISSES));
+    sched_traces[sched_trace_idx].analysis_cycle = gr_window_value(&self_perf_windows[self_w],
+        gr_perfctr_role_index(GR_ROLE_CYCLES));
     sched_traces[sched_trace_idx].duration = rc;
     sched_trace_idx ++; 
 #endif
@@ -213,6 +279,159 @@ static int gr_register_scheduler(gr_scheduler_t sched_handle,
     return 0;
 } 
 
+/*
+ * Forget a scheduler whose init failed, so it is not finalized
+ */
+static void gr_unregister_scheduler(gr_scheduler_t sched_handle)
+{
+    free(sched_handle->name);
+    sched_handle->name = NULL;
+    sched_handle->init_func = NULL;
+    sched_handle->finalize_func = NULL;
+    sched_handle->sched_func = NULL;
+    sched_handle->client_data = NULL;
+}
+
+/*
+ * A scheduler loaded from a plugin
+ */
+typedef struct _gr_plugin_sched {
+    void *handle;
+    gr_sched_plugin_t plugin;
+    void *client_data;
+} gr_plugin_sched, *gr_plugin_sched_t;
+
+static gr_sched_env gr_plugin_env;
+
+static perf_window_t gr_env_sim_window(int age)
+{
+    if(age < 0 || age >= perf_window_size || !perf_windows) {
+        return NULL;
+    }
+    return &perf_windows[(perf_window_idx + perf_window_size - 1 - age) % perf_window_size];
+}
+
+static perf_window_t gr_env_self_window(int age)
+{
+    if(age < 0 || age >= self_perf_window_size || !self_perf_windows) {
+        return NULL;
+    }
+    return &self_perf_windows[(self_perf_window_idx + self_perf_window_size - 1 - age) % 
+        self_perf_window_size];
+}
+
+static int gr_env_sim_role_index(int role)
+{
+    if(!gr_monitor_buffer || role < 0 || role >= GR_NUM_ROLES) {
+        return -1;
+    }
+    return gr_monitor_buffer->roles[role];
+}
+
+static int gr_env_node_summary(gr_node_summary_t summary)
+{
+    if(!gr_node_monitor) {
+        return -1;
+    }
+    gr_node_read_summary(gr_node_monitor, summary);
+    return 0;
+}
+
+static int gr_plugin_sched_init(void *client_data)
+{
+    gr_plugin_sched_t p = (gr_plugin_sched_t) client_data;
+    if(p->plugin->init) {
+        return (*p->plugin->init) (&gr_plugin_env, &p->client_data);
+    }
+    return 0;
+}
+
+static int gr_plugin_sched_finalize(void *client_data)
+{
+    gr_plugin_sched_t p = (gr_plugin_sched_t) client_data;
+    int rc = 0;
+    if(p->plugin->finalize) {
+        rc = (*p->plugin->finalize) (&gr_plugin_env, p->client_data);
+    }
+    dlclose(p->handle);
+    free(p);
+    return rc;
+}
+
+static int gr_plugin_sched_func(void *client_data)
+{
+    gr_plugin_sched_t p = (gr_plugin_sched_t) client_data;
+    return (*p->plugin->decide) (&gr_plugin_env, p->client_data);
+}
+
+/*
+ * Open the plugin of a scheduler: sched_name itself if it is a path, or 
+ * gr_sched_<sched_name>.so in the first directory of GR_SCHEDULER_PATH
+ * which has one. Return NULL if there is no usable plugin.
+ */
+static gr_plugin_sched_t gr_load_plugin(char *sched_name)
+{
+    void *handle = NULL;
+    char path[PATH_MAX];
+    if(strchr(sched_name, '/')) {
+        snprintf(path, sizeof(path), "%s", sched_name);
+        handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    }
+    else {
+        const char *dir = getenv("GR_SCHEDULER_PATH");
+        int found = 0;
+        while(dir && !found) {
+            const char *end = strchr(dir, ':');
+            int len = end ? (int) (end - dir) : (int) strlen(dir);
+            if(len > 0) {
+                snprintf(path, sizeof(path), "%.*s/%s%s%s", len, dir, 
+                    GR_SCHED_PLUGIN_PREFIX, sched_name, GR_SCHED_PLUGIN_SUFFIX);
+                found = (access(path, R_OK) == 0);
+            }
+            dir = end ? end + 1 : NULL;
+        }
+        if(!found) {
+            return NULL;
+        }
+        handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    }
+    if(!handle) {
+        fprintf(stderr, "Error: cannot load scheduler plugin %s: %s. %s:%d\n",
+            path, dlerror(), __FILE__, __LINE__);
+        return NULL;
+    }
+
+    gr_sched_plugin_t plugin = (gr_sched_plugin_t) dlsym(handle, GR_SCHED_PLUGIN_SYMBOL);
+    if(!plugin) {
+        fprintf(stderr, "Error: %s has no %s. %s:%d\n",
+            path, GR_SCHED_PLUGIN_SYMBOL, __FILE__, __LINE__);
+        dlclose(handle);
+        return NULL;
+    }
+    if(plugin->abi_version != GR_SCHED_PLUGIN_ABI_VERSION) {
+        fprintf(stderr, "Error: %s is built for scheduler ABI %d, not %d. %s:%d\n",
+            path, plugin->abi_version, GR_SCHED_PLUGIN_ABI_VERSION, __FILE__, __LINE__);
+        dlclose(handle);
+        return NULL;
+    }
+    if(!plugin->decide) {
+        fprintf(stderr, "Error: %s has no decide function. %s:%d\n",
+            path, __FILE__, __LINE__);
+        dlclose(handle);
+        return NULL;
+    }
+    gr_plugin_sched_t p = (gr_plugin_sched_t) malloc(sizeof(gr_plugin_sched));
+    if(!p) {
+        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+        dlclose(handle);
+        return NULL;
+    }
+    p->handle = handle;
+    p->plugin = plugin;
+    p->client_data = NULL;
+    return p;
+}
+
 int gr_internal_load_scheduler(char *sched_name, int interval)
 {
     int rc;
@@ -238,7 +457,7 @@ int gr_internal_load_scheduler(char *sched_name, int interval)
         }
         char *temp_str = getenv("GR_SCHED_IPC_THRESHOLD");
         if(temp_str) {
-            param->ipc_threshold = (double) atoi(temp_str);
+            param->ipc_threshold = atof(temp_str);
         }
         else {
             param->ipc_threshold = 1;
@@ -252,6 +471,24 @@ int gr_internal_load_scheduler(char *sched_name, int interval)
             param->l2_miss_threshold = 10;
         }
 
+        temp_str = getenv("GR_SCHED_RUN_DELAY_THRESHOLD");
+        if(temp_str) {
+            param->run_delay_threshold = atof(temp_str);
+        }
+        else {
+            param->run_delay_threshold = 0.05;
+        }
+        temp_str = getenv("GR_SCHED_NODE_BANDWIDTH");
+        if(temp_str) {
+            param->node_bandwidth_threshold = atof(temp_str);
+        }
+        else {
+            param->node_bandwidth_threshold = 0;
+        }
+        param->self_cycles_event = gr_perfctr_role_index(GR_ROLE_CYCLES);
+        param->self_llc_misses_event = gr_perfctr_role_index(GR_ROLE_LLC_MISSES);
+        param->warned = 0;
+
         temp_str = getenv("GR_SCHED_SLEEP");
         if(temp_str) {
             param->sleep_duration = (double) atoi(temp_str);
@@ -273,10 +510,33 @@ int gr_internal_load_scheduler(char *sched_name, int interval)
         return 0;
     }
     else {
-        fprintf(stderr, "Error: unknown scheduler %s.\n", sched_name);
-        return -1;
+        // a site-specific policy, built outside the library
+        gr_plugin_sched_t p = gr_load_plugin(sched_name);
+        if(!p) {
+            fprintf(stderr, "Error: unknown scheduler %s.\n", sched_name);
+            return -1;
+        }
+        gr_plugin_env.abi_version = GR_SCHED_PLUGIN_ABI_VERSION;
+        gr_plugin_env.interval_us = scheduling_interval_us;
+        gr_plugin_env.sim_window = gr_env_sim_window;
+        gr_plugin_env.self_window = gr_env_self_window;
+        gr_plugin_env.sim_role_index = gr_env_sim_role_index;
+        gr_plugin_env.self_role_index = gr_perfctr_role_index;
+        gr_plugin_env.node_summary = gr_env_node_summary;
+        rc = gr_register_scheduler(&gr_global_scheduler,
+                                   sched_name,
+                                   gr_plugin_sched_init,
+                                   gr_plugin_sched_finalize,
+                                   gr_plugin_sched_func,
+                                   p
+                                  );
+        if(rc) {
+            dlclose(p->handle);
+            free(p);
+        }
     }
     if(rc) {
+        gr_unregister_scheduler(&gr_global_scheduler);
         fprintf(stderr, "Error: loading scheduler %s returns %d. %s:%d\n",
             sched_name, rc, __FILE__, __LINE__);
         return -1;
@@ -298,6 +558,13 @@ fprintf(stderr, "analysis comm rank %d local rank %d sim rank %d\n", gr_comm_ran
     gr_mon_buffer_region = gr_attach_monitor_buffer(gr_shm_handle, sim_shm_key);
     gr_monitor_buffer = (gr_mon_buffer_t) gr_mon_buffer_region->starting_addr;
 
+    // the node-wide load of the simulation, one region for all its ranks
+    key_t node_shm_key = GR_NODE_MONITOR_KEY_BASE + sim->app_id;
+    gr_node_monitor_region = gr_attach_node_monitor(gr_shm_handle, node_shm_key);
+    if(gr_node_monitor_region) {
+        gr_node_monitor = (gr_node_mon_t) gr_node_monitor_region->starting_addr;
+    }
+
     char *ws_str = getenv("GR_SCHED_WINDOW_SIZE");
     if(ws_str) {
         perf_window_size = atoi(ws_str);
@@ -308,6 +575,13 @@ fprintf(stderr, "analysis comm rank %d local rank %d sim rank %d\n", gr_comm_ran
             __FILE__, __LINE__);
         return -1;
     }
+    int i, m;
+    for(i = 0; i < perf_window_size; i ++) {
+        // nothing measured yet
+        for(m = 0; m < GR_NUM_METRICS; m ++) {
+            perf_windows[i].metrics[m] = -1;
+        }
+    }
     perf_window_idx = 0;
     self_perf_window_size = perf_window_size;
     self_perf_windows = (perf_window_t) malloc(self_perf_window_size * sizeof(perf_window));
@@ -317,6 +591,8 @@ fprintf(stderr, "analysis comm rank %d local rank %d sim rank %d\n", gr_comm_ran
         return -1;
     }
     self_perf_window_idx = 0;
+    gr_plugin_env.window_size = perf_window_size;
+    gr_plugin_env.self_window_size = self_perf_window_size;
 
     // establish signal handler
     struct sigaction psa;
@@ -361,6 +637,9 @@ int gr_finalize_scheduler()
 
     // diable timer and signal handler
     disable_scheduler = 1;
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
     sigaction(SIGALRM, &old_sa, NULL);
 
     if(gr_global_scheduler.finalize_func) {
@@ -373,6 +652,10 @@ int gr_finalize_scheduler()
     free(perf_windows);
     free(self_perf_windows);
     rc = gr_destroy_monitor_buffer(gr_mon_buffer_region);
+    if(gr_node_monitor_region) {
+        gr_node_monitor = NULL;
+        gr_destroy_node_monitor(gr_node_monitor_region);
+    }
 
 #ifdef DEBUG_TIMING
     dump_sched_trace();
@@ -419,15 +702,50 @@ int gr_contention_sched_func(void *client_data)
 {
     contention_sched_param_t param = (contention_sched_param_t) client_data;
 
+    // the windows filled last
+    int w = (perf_window_idx + perf_window_size - 1) % perf_window_size;
+    int self_w = (self_perf_window_idx + self_perf_window_size - 1) % self_perf_window_size;
+
+    // the simulation's events, which need not be those of this process
+    int task_clock_event = gr_mon_buffer_role_index(gr_monitor_buffer, "task-clock");
+    int run_delay_event = gr_mon_buffer_role_index(gr_monitor_buffer, "run-delay");
+    if(task_clock_event != -1 && run_delay_event != -1) {
+        // software counters: the simulation waiting for a CPU is what the
+        // analytics costs it
+        long long *sim = perf_windows[w].pctr_values;
+        double run = sim[task_clock_event];
+        double wait = sim[run_delay_event];
+        if(run + wait > 0 && wait / (run + wait) > param->run_delay_threshold) {
+            return (int) param->sleep_duration;
+        }
+        return 0;
+    }
+
     // use a contention model to decide
     // 1. whether simulation is suffering from contention
     // 2. whether this process is causing the contention
-    long long num_cycles = perf_windows[perf_window_idx-1].pctr_values[0];    
-    long long num_intrs = perf_windows[perf_window_idx-1].pctr_values[1];    
-    double ipc = num_intrs / num_cycles;
+    if(gr_mon_buffer_role_index(gr_monitor_buffer, "cycles") == -1 ||
+       gr_mon_buffer_role_index(gr_monitor_buffer, "instructions") == -1 ||
+       param->self_cycles_event == -1 || param->self_llc_misses_event == -1) {
+        if(!param->warned) {
+            fprintf(stderr, "Warning: contention scheduler needs task-clock and run-delay events "
+                "of the simulation, or cycles and instructions of the simulation and cycles and "
+                "llc-misses of the analytics; analytics always runs.\n");
+            param->warned = 1;
+        }
+        return 0;
+    }
+    double ipc = perf_windows[w].metrics[GR_METRIC_IPC];
+    if(ipc < 0) {
+        // cannot tell if the simulation suffers
+        return 0;
+    }
 
-    long long *window = self_perf_windows[self_perf_window_idx-1].pctr_values;
-    double l2_miss_rate = window[2] / window[0] * 1000;
+    // last level cache misses per 1000 cycles of this process
+    long long *window = self_perf_windows[self_w].pctr_values;
+    double self_cycles = window[param->self_cycles_event];
+    double l2_miss_rate = (self_cycles > 0) ?
+        window[param->self_llc_misses_event] / self_cycles * 1000 : 0;
 
     if(ipc < param->ipc_threshold) {
         if(l2_miss_rate > param->l2_miss_threshold) {
@@ -435,6 +753,16 @@ int gr_contention_sched_func(void *client_data)
         }
     }
 
+    // other simulation ranks on the node may suffer even if ours does not
+    if(param->node_bandwidth_threshold > 0 && gr_node_monitor) {
+        gr_node_summary node;
+        gr_node_read_summary(gr_node_monitor, &node);
+        if(node.num_measured > 0 && node.bandwidth > param->node_bandwidth_threshold &&
+           l2_miss_rate > param->l2_miss_threshold) {
+            return (int) param->sleep_duration;
+        }
+    }
+
     return 0;
 }
 
@@ -12,7 +12,10 @@
 
 typedef struct _perf_window {
     int phase_id;
+    uint64_t timestamp; // when the simulation took the last sample, in ns
+    uint64_t interval; // ns covered by the samples
     long long pctr_values[NUM_EVENTS];
+    double metrics[GR_NUM_METRICS]; // as published by the simulation's stub
 } perf_window, *perf_window_t;
 
 typedef int (* gr_sched_init_func) (void *client_data);
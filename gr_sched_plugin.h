@@ -0,0 +1,73 @@
+#ifndef _GR_SCHED_PLUGIN_H_
+#define _GR_SCHED_PLUGIN_H_
+/**
+ * Scheduler plugin ABI
+ *
+ * A scheduling policy can be built as a shared object outside the library.
+ * gr_load_scheduler(name, ...) looks for gr_sched_<name>.so in the
+ * directories of GR_SCHEDULER_PATH (separated by ':'), or loads name itself
+ * if it is a path, and takes the gr_sched_plugin structure it exports as
+ * GR_SCHED_PLUGIN_SYMBOL:
+ *
+ *   #include "gr_sched_plugin.h"
+ *
+ *   static int my_decide(gr_sched_env_t env, void *client_data)
+ *   {
+ *       perf_window_t w = env->sim_window(0);
+ *       return (w && w->metrics[GR_METRIC_IPC] >= 0 &&
+ *               w->metrics[GR_METRIC_IPC] < 0.5) ? 200 : 0;
+ *   }
+ *
+ *   gr_sched_plugin gr_sched_plugin_entry = {
+ *       GR_SCHED_PLUGIN_ABI_VERSION, "my", NULL, NULL, my_decide
+ *   };
+ *
+ * A plugin is refused unless it was built against the same
+ * GR_SCHED_PLUGIN_ABI_VERSION, which changes whenever perf_window,
+ * gr_node_summary, gr_sched_env or gr_sched_plugin change layout.
+ */
+#include <stdint.h>
+#include "gr_sched.h"
+#include "gr_node_monitor.h"
+
+#define GR_SCHED_PLUGIN_ABI_VERSION 1
+#define GR_SCHED_PLUGIN_SYMBOL "gr_sched_plugin_entry"
+#define GR_SCHED_PLUGIN_PREFIX "gr_sched_"
+#define GR_SCHED_PLUGIN_SUFFIX ".so"
+
+/*
+ * What the library offers a plugin. Windows are refreshed before every
+ * decision; age 0 is the latest window, NULL past the oldest one kept.
+ */
+typedef struct _gr_sched_env {
+    int abi_version;
+    int interval_us; // between decisions
+    int window_size; // windows kept of the simulation
+    int self_window_size; // windows kept of this process
+
+    // the simulation's counters, folded from its monitor buffer
+    perf_window_t (*sim_window)(int age);
+    // this process's counters; their metrics are not computed
+    perf_window_t (*self_window)(int age);
+
+    // index in pctr_values of the event with a GR_ROLE_*, or -1
+    int (*sim_role_index)(int role);
+    int (*self_role_index)(int role);
+
+    // load of all simulation ranks on the node; return -1 without it
+    int (*node_summary)(gr_node_summary_t summary);
+} gr_sched_env, *gr_sched_env_t;
+
+typedef struct _gr_sched_plugin {
+    int abi_version; // GR_SCHED_PLUGIN_ABI_VERSION the plugin was built with
+    const char *name;
+    // optional: set up, e.g. from environment variables, and return the
+    // client data passed to the other calls. Return 0 for success.
+    int (*init)(gr_sched_env_t env, void **client_data);
+    // optional
+    int (*finalize)(gr_sched_env_t env, void *client_data);
+    // return how many us the analytics should wait, 0 to let it run
+    int (*decide)(gr_sched_env_t env, void *client_data);
+} gr_sched_plugin, *gr_sched_plugin_t;
+
+#endif
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <string.h>
+#include "gr_stats.h"
+
+static inline int gr_stats_bucket(uint64_t x)
+{
+    if(x < GR_STATS_SUB_BUCKETS) {
+        return (int) x;
+    }
+    int msb = 63 - __builtin_clzll(x);
+    // the bits right below the most significant one select the sub-bucket
+    int sub = (int) ((x >> (msb - GR_STATS_SUB_BUCKET_BITS)) & (GR_STATS_SUB_BUCKETS - 1));
+    return (msb - GR_STATS_SUB_BUCKET_BITS + 1) * GR_STATS_SUB_BUCKETS + sub;
+}
+
+/*
+ * Smallest value falling into bucket b
+ */
+static inline uint64_t gr_stats_bucket_low(int b)
+{
+    if(b < GR_STATS_SUB_BUCKETS) {
+        return (uint64_t) b;
+    }
+    int msb = b / GR_STATS_SUB_BUCKETS + GR_STATS_SUB_BUCKET_BITS - 1;
+    uint64_t sub = (uint64_t) (b % GR_STATS_SUB_BUCKETS);
+    return (1ULL << msb) | (sub << (msb - GR_STATS_SUB_BUCKET_BITS));
+}
+
+/*
+ * Move the histogram window of s to start at bucket new_base, folding the
+ * buckets which fall off into the one at that end
+ */
+static void gr_stats_slide(gr_stats_t s, int new_base)
+{
+    uint32_t h[GR_STATS_NUM_BUCKETS];
+    uint32_t top = 0;
+    int i;
+    memset(h, 0, sizeof(h));
+    for(i = 0; i < GR_STATS_NUM_BUCKETS; i ++) {
+        int j = i + (int) s->hist_base - new_base;
+        if(j < 0) j = 0;
+        if(j >= GR_STATS_NUM_BUCKETS) j = GR_STATS_NUM_BUCKETS - 1;
+        h[j] += s->hist[i];
+        if(h[j] > top) top = h[j];
+    }
+    int shift = 0;
+    while((top >> shift) > UINT8_MAX) {
+        shift ++;
+    }
+    for(i = 0; i < GR_STATS_NUM_BUCKETS; i ++) {
+        s->hist[i] = (uint8_t) (h[i] >> shift);
+    }
+    s->hist_base = (uint8_t) new_base;
+}
+
+/*
+ * Add n samples to bucket b (over all of uint64_t), n <= UINT8_MAX
+ */
+static inline void gr_stats_add(gr_stats_t s, int b, uint32_t n)
+{
+    if(b < (int) s->hist_base) {
+        gr_stats_slide(s, b - b % GR_STATS_SUB_BUCKETS);
+    }
+    else if(b >= (int) s->hist_base + GR_STATS_NUM_BUCKETS) {
+        // b's power of two becomes the last one covered
+        gr_stats_slide(s, b - b % GR_STATS_SUB_BUCKETS - 
+            (GR_STATS_NUM_BUCKETS - GR_STATS_SUB_BUCKETS));
+    }
+    int i = b - (int) s->hist_base;
+    while(s->hist[i] + n > UINT8_MAX) {
+        // a bucket is full: age all of them
+        int k;
+        for(k = 0; k < GR_STATS_NUM_BUCKETS; k ++) {
+            s->hist[k] >>= 1;
+        }
+    }
+    s->hist[i] += n;
+}
+
+void gr_stats_init(gr_stats_t s)
+{
+    memset(s, 0, sizeof(gr_stats));
+}
+
+void gr_stats_update(gr_stats_t s, uint64_t x)
+{
+    int b = gr_stats_bucket(x);
+    s->count ++;
+    double delta = (double) x - s->mean;
+    s->mean += delta / s->count;
+    s->m2 += delta * ((double) x - s->mean);
+    if(s->count == 1 || x < s->min) {
+        s->min = x;
+    }
+    if(x > s->max) {
+        s->max = x;
+    }
+    if(s->count == 1) {
+        // center the histogram on the first sample
+        int base = b - b % GR_STATS_SUB_BUCKETS - 
+            GR_STATS_OCTAVES_BELOW * GR_STATS_SUB_BUCKETS;
+        if(base < 0) base = 0;
+        if(base > GR_STATS_MAX_BUCKETS - GR_STATS_NUM_BUCKETS) {
+            base = GR_STATS_MAX_BUCKETS - GR_STATS_NUM_BUCKETS;
+        }
+        s->hist_base = (uint8_t) base;
+    }
+    gr_stats_add(s, b, 1);
+}
+
+/*
+ * Add the histogram of s to w, which has a bucket for all of uint64_t, in
+ * samples rather than aged counts
+ */
+static void gr_stats_weigh(double *w, gr_stats_t s)
+{
+    uint64_t total = 0;
+    int i;
+    for(i = 0; i < GR_STATS_NUM_BUCKETS; i ++) {
+        total += s->hist[i];
+    }
+    if(total == 0) {
+        return;
+    }
+    double scale = (double) s->count / total;
+    for(i = 0; i < GR_STATS_NUM_BUCKETS; i ++) {
+        w[s->hist_base + i] += s->hist[i] * scale;
+    }
+}
+
+void gr_stats_merge(gr_stats_t dst, gr_stats_t src)
+{
+    if(src->count == 0) {
+        return;
+    }
+    if(dst->count == 0) {
+        memcpy(dst, src, sizeof(gr_stats));
+        return;
+    }
+
+    // the two histograms may have been aged differently
+    double w[GR_STATS_MAX_BUCKETS];
+    memset(w, 0, sizeof(w));
+    gr_stats_weigh(w, dst);
+    gr_stats_weigh(w, src);
+    int lo = 0, hi = GR_STATS_MAX_BUCKETS - 1;
+    while(lo < hi && w[lo] == 0) lo ++;
+    while(hi > lo && w[hi] == 0) hi --;
+    int base = dst->hist_base;
+    if(lo < base) {
+        base = lo - lo % GR_STATS_SUB_BUCKETS;
+    }
+    if(hi >= base + GR_STATS_NUM_BUCKETS) {
+        base = hi - hi % GR_STATS_SUB_BUCKETS - 
+            (GR_STATS_NUM_BUCKETS - GR_STATS_SUB_BUCKETS);
+    }
+    double h[GR_STATS_NUM_BUCKETS];
+    double top = 0;
+    int i;
+    memset(h, 0, sizeof(h));
+    for(i = lo; i <= hi; i ++) {
+        int j = i - base;
+        if(j < 0) j = 0;
+        if(j >= GR_STATS_NUM_BUCKETS) j = GR_STATS_NUM_BUCKETS - 1;
+        h[j] += w[i];
+        if(h[j] > top) top = h[j];
+    }
+    double scale = (top > UINT8_MAX) ? UINT8_MAX / top : 1;
+    for(i = 0; i < GR_STATS_NUM_BUCKETS; i ++) {
+        dst->hist[i] = (uint8_t) (h[i] * scale + 0.5);
+    }
+    dst->hist_base = (uint8_t) base;
+
+    // parallel variant of Welford's algorithm (Chan et al.)
+    uint64_t n = dst->count + src->count;
+    double delta = src->mean - dst->mean;
+    dst->mean += delta * src->count / n;
+    dst->m2 += src->m2 + delta * delta * ((double) dst->count * src->count / n);
+    dst->count = n;
+    if(src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if(src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+double gr_stats_variance(gr_stats_t s)
+{
+    return (s->count < 2) ? 0 : s->m2 / (s->count - 1);
+}
+
+uint64_t gr_stats_quantile(gr_stats_t s, double q)
+{
+    if(s->count == 0) {
+        return 0;
+    }
+    if(q <= 0) {
+        return s->min;
+    }
+    if(q >= 1) {
+        return s->max;
+    }
+    // counts may have been aged, go by their sum rather than s->count
+    uint64_t total = 0;
+    int i;
+    for(i = 0; i < GR_STATS_NUM_BUCKETS; i ++) {
+        total += s->hist[i];
+    }
+    uint64_t rank = (uint64_t) (q * total);
+    uint64_t seen = 0;
+    for(i = 0; i < GR_STATS_NUM_BUCKETS - 1; i ++) {
+        seen += s->hist[i];
+        if(seen > rank) {
+            break;
+        }
+    }
+    // take the middle of the bucket, within the observed range
+    int b = (int) s->hist_base + i;
+    uint64_t low = gr_stats_bucket_low(b);
+    uint64_t high = (b + 1 < GR_STATS_MAX_BUCKETS) ? gr_stats_bucket_low(b + 1) : s->max;
+    uint64_t v = low + (high - low) / 2;
+    if(v < s->min) v = s->min;
+    if(v > s->max) v = s->max;
+    return v;
+}
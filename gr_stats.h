@@ -0,0 +1,57 @@
+#ifndef _GR_STATS_H_
+#define _GR_STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Streaming statistics of a sample stream (e.g. phase lengths) in O(1) 
+ * memory: Welford mean/variance and a log-bucketed histogram for quantiles.
+ *
+ * Each power of two is split into GR_STATS_SUB_BUCKETS buckets, so a 
+ * quantile is accurate to within a bucket width (about 1/GR_STATS_SUB_BUCKETS
+ * of the value). The statistics are updated on every measured occurrence of
+ * a phase, so all of them fit in one cache line: the histogram covers 
+ * GR_STATS_NUM_OCTAVES powers of two, starting GR_STATS_OCTAVES_BELOW below
+ * the first sample, and slides when a sample falls outside, folding the 
+ * buckets slid off into the one at that end. Counts are halved when a 
+ * bucket fills up, so quantiles follow the recent samples.
+ */
+#define GR_STATS_SUB_BUCKET_BITS 1
+#define GR_STATS_SUB_BUCKETS (1 << GR_STATS_SUB_BUCKET_BITS)
+#define GR_STATS_NUM_OCTAVES 10
+#define GR_STATS_OCTAVES_BELOW 5
+#define GR_STATS_NUM_BUCKETS (GR_STATS_NUM_OCTAVES * GR_STATS_SUB_BUCKETS)
+// over all of uint64_t: values below GR_STATS_SUB_BUCKETS have a bucket each
+#define GR_STATS_MAX_BUCKETS ((64 - GR_STATS_SUB_BUCKET_BITS + 1) * GR_STATS_SUB_BUCKETS)
+
+typedef struct _gr_stats {
+    uint64_t count;
+    double mean;
+    double m2;      // sum of squared differences from the mean
+    uint64_t min;
+    uint64_t max;
+    uint8_t hist_base; // bucket over all of uint64_t that hist[0] is
+    uint8_t hist[GR_STATS_NUM_BUCKETS];
+} gr_stats, *gr_stats_t;
+
+void gr_stats_init(gr_stats_t s);
+
+/*
+ * Add a sample
+ */
+void gr_stats_update(gr_stats_t s, uint64_t x);
+
+/*
+ * Merge the samples of src into dst
+ */
+void gr_stats_merge(gr_stats_t dst, gr_stats_t src);
+
+double gr_stats_variance(gr_stats_t s);
+
+/*
+ * Estimate the q-quantile (0 <= q <= 1) from the histogram.
+ * Return 0 if there is no sample.
+ */
+uint64_t gr_stats_quantile(gr_stats_t s, double q);
+
+#endif
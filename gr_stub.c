@@ -1,16 +1,27 @@
+#define _GNU_SOURCE // pthread_setaffinity_np()
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "rdtsc.h"
 #include "gr_monitor_buffer.h"
+#include "gr_node_monitor.h"
 #include "gr_perfctr.h"
 #include "gr_stub.h"
 
 /* Tunable parameters */
 int timer_interval_us;  // timer interval in micro-seconds 
-int num_lock_tries;     // number of locking attempts on monitor buffer
+uint64_t snapshot_max_age; // reuse a phase transition snapshot this recent, in ns
+int stub_target_samples = GR_STUB_DEFAULT_SAMPLES; // per phase occurrence, 0 to disable
+uint64_t stub_min_interval_ns = GR_STUB_DEFAULT_MIN_INTERVAL * 1000;
+uint64_t stub_max_interval_ns = GR_STUB_DEFAULT_MAX_INTERVAL * 1000;
+double stub_max_overhead = GR_STUB_DEFAULT_OVERHEAD;
 
 /* Global data */
 volatile sig_atomic_t disable_handler = 0;
@@ -18,12 +29,72 @@ struct sigaction old_sa;
 long long perfctr_values1[NUM_EVENTS];
 long long perfctr_values2[NUM_EVENTS];
 long long *current_pctr, *old_pctr;
+uint64_t window_start; // when old_pctr was read
 struct itimerval start_t;
 struct itimerval end_t;
+volatile uint64_t gr_stub_time = 0;
+int gr_stub_mode = GR_STUB_MODE_SIGNAL;
+static int gr_stub_armed = 0; // the timer is set for the current phase
+
+// what sampling has cost so far, in either mode
+static volatile uint64_t gr_stub_sample_time = 0;
+static volatile uint64_t gr_stub_num_samples = 0;
+
+/*
+ * Thread mode: the phase markers only flip gr_stub_active. The sampling
+ * thread raises gr_stub_busy before it looks at gr_stub_active, and the
+ * phase end waits for it to drop, so no sample is taken across a phase end
+ * and the counters can be switched between phases.
+ *
+ * The thread sleeps on the futex gr_stub_wakeups until the next sample of
+ * the phase is due. Once it finds no phase open it parks there without a
+ * timeout; only then does a phase start bump gr_stub_wakeups and wake it.
+ */
+static pthread_t gr_stub_thread;
+static volatile int gr_stub_stop = 0;
+static volatile int gr_stub_active = 0;
+static volatile int gr_stub_busy = 0;
+static volatile int gr_stub_parked = 0;
+static volatile int gr_stub_wakeups = 0;
+static volatile uint32_t gr_stub_phase_count = 0; // a new count means a new baseline
+static long long gr_stub_base[NUM_EVENTS]; // counters at the start of the phase
+static uint64_t gr_stub_base_time;
+static uint64_t gr_stub_interval_ns; // of the current phase
 
 extern gr_mon_buffer_t gr_monitor_buffer;
+extern gr_node_mon_t gr_node_monitor;
+extern int gr_local_rank;
 extern current_phase_id;
 
+/*
+ * Publish the sample ending at t0. cur holds the counters read at t0 and
+ * old those read at *start; old is turned into the deltas.
+ */
+static void gr_stub_sample(long long *cur, long long *old, uint64_t t0, uint64_t *start)
+{
+    int j, num_events = gr_perfctr_num_events();
+    for(j = 0; j < num_events; j ++) {
+        old[j] = cur[j] - old[j]; 
+    }
+    uint64_t interval = t0 - *start;
+    double metrics[GR_NUM_METRICS];
+    gr_perfctr_compute_metrics(old, interval, metrics);
+    *start = t0;
+         
+    // never blocks, every sample reaches the monitor buffer
+    gr_publish_sample(gr_monitor_buffer, current_phase_id, t0, interval, old, metrics);
+    if(gr_node_monitor) {
+        // the stub samples the main thread, slot 0 of this rank
+        int slot = gr_node_slot_index(gr_node_monitor, gr_local_rank, 0);
+        if(slot != -1) {
+            gr_node_publish_sample(gr_node_monitor, slot, current_phase_id, t0, interval, metrics);
+        }
+        if(gr_local_rank == 0) {
+            gr_node_publish_summary(gr_node_monitor, t0);
+        }
+    }
+}
+
 void gr_timer_handler(int signum)
 {
 //printf("TIMER: im here %s %d\n", __FILE__, __LINE__);
@@ -31,45 +102,177 @@ void gr_timer_handler(int signum)
         return;
     }
 
-    int rc = 0;
+    // the handler runs inside a phase, its time is overhead
+    uint64_t t0 = gr_clock_ns();
     // read performance counters into temp buffer
-    gr_perfctr_read(current_pctr);
-    int j;
-    for(j = 0; j < NUM_EVENTS; j ++) {
-        old_pctr[j] = current_pctr[j] - old_pctr[j]; 
-    }
-         
-    // try to lock monitor buffer
-    int i = 0;
-    while(i < num_lock_tries) {
-        rc = pthread_rwlock_trywrlock(&gr_monitor_buffer->rwlock);
-        if(rc == 0) {
-            // have locked monitor buffer
-            // update shared memory monitor buffer
-            gr_monitor_buffer->phase_id = current_phase_id;
-            long long *dest = gr_monitor_buffer->perfctr_values; 
-            for(j = 0; j < NUM_EVENTS; j ++) {
-                dest[j] = old_pctr[j];
-            }
-            pthread_rwlock_unlock(&gr_monitor_buffer->rwlock); 
-            break;
-        } 
-        i ++;
-    }    
+    gr_perfctr_read_recent(current_pctr, t0, snapshot_max_age);
+    gr_stub_sample(current_pctr, old_pctr, t0, &window_start);
     long long *temp_p = current_pctr;   
     current_pctr = old_pctr;   
     old_pctr = temp_p;
 
     // re-install timer
     setitimer(ITIMER_REAL, &start_t, NULL);
+    uint64_t t = gr_clock_ns() - t0;
+    gr_stub_time += t;
+    gr_stub_sample_time += t;
+    gr_stub_num_samples ++;
 //printf("TIMER: end im here %s %d\n", __FILE__, __LINE__);
 }
 
+static void gr_stub_wait(struct timespec *timeout, int wakeups)
+{
+    syscall(SYS_futex, &gr_stub_wakeups, FUTEX_WAIT_PRIVATE, wakeups, timeout, NULL, 0);
+}
+
+static void gr_stub_wake()
+{
+    __atomic_add_fetch(&gr_stub_wakeups, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &gr_stub_wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Sampling thread of thread mode. It wakes up when a sample of the main
+ * thread's phase is due, and sleeps while the main thread is not in a phase.
+ */
+static void *gr_stub_thread_func(void *arg)
+{
+    long long values1[NUM_EVENTS];
+    long long values2[NUM_EVENTS];
+    long long *cur = values1, *old = values2;
+    uint64_t start = 0;
+    uint32_t seen_phase = 0;
+
+    while(!gr_stub_stop) {
+        int wakeups = __atomic_load_n(&gr_stub_wakeups, __ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&gr_stub_active, __ATOMIC_SEQ_CST)) {
+            // park until a phase starts, see gr_stub_phase_start()
+            __atomic_store_n(&gr_stub_parked, 1, __ATOMIC_SEQ_CST);
+            if(!__atomic_load_n(&gr_stub_active, __ATOMIC_SEQ_CST)) {
+                gr_stub_wait(NULL, wakeups);
+            }
+            __atomic_store_n(&gr_stub_parked, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        uint64_t wait = stub_min_interval_ns;
+        __atomic_store_n(&gr_stub_busy, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&gr_stub_active, __ATOMIC_SEQ_CST)) {
+            uint32_t n = __atomic_load_n(&gr_stub_phase_count, __ATOMIC_ACQUIRE);
+            if(n != seen_phase) {
+                // first sample of a phase: start from the phase's counters
+                memcpy(old, gr_stub_base, gr_perfctr_num_events() * sizeof(long long));
+                start = gr_stub_base_time;
+                seen_phase = n;
+            }
+            uint64_t t0 = gr_clock_ns();
+            if(t0 - start >= gr_stub_interval_ns && !gr_perfctr_read(cur)) {
+                gr_stub_sample(cur, old, t0, &start);
+                long long *temp_p = cur;
+                cur = old;
+                old = temp_p;
+                gr_stub_sample_time += gr_clock_ns() - t0;
+                gr_stub_num_samples ++;
+            }
+            if(start + gr_stub_interval_ns > t0) {
+                wait = start + gr_stub_interval_ns - t0;
+            }
+        }
+        __atomic_store_n(&gr_stub_busy, 0, __ATOMIC_RELEASE);
+
+        // a phase ending meanwhile is seen when the thread wakes up
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000000;
+        ts.tv_nsec = (long) (wait % 1000000000);
+        gr_stub_wait(&ts, wakeups);
+    }
+    return NULL;
+}
+
+/*
+ * Sampling interval of a phase expected to last expected_length ns
+ */
+static uint64_t gr_stub_interval(uint64_t expected_length)
+{
+    uint64_t interval = (uint64_t) timer_interval_us * 1000;
+    if(stub_target_samples > 0 && expected_length > 0) {
+        interval = expected_length / stub_target_samples;
+    }
+    if(interval < stub_min_interval_ns) {
+        interval = stub_min_interval_ns;
+    }
+    if(interval > stub_max_interval_ns) {
+        interval = stub_max_interval_ns;
+    }
+    // the overhead bound wins over the ceiling
+    uint64_t n = gr_stub_num_samples;
+    if(n > 0 && stub_max_overhead > 0) {
+        uint64_t min_interval = (uint64_t) (gr_stub_sample_time / n / stub_max_overhead);
+        if(interval < min_interval) {
+            interval = min_interval;
+        }
+    }
+    return interval;
+}
+
+/*
+ * Start the sampling thread, pinned to GR_STUB_CPU if it is set
+ */
+static int gr_stub_start_thread()
+{
+    gr_stub_stop = 0;
+    int rc = pthread_create(&gr_stub_thread, NULL, gr_stub_thread_func, NULL);
+    if(rc) {
+        fprintf(stderr, "Error: pthread_create() returns %d. %s:%d\n",
+            rc, __FILE__, __LINE__);
+        return -1;
+    }
+
+    char *cpu_str = getenv("GR_STUB_CPU");
+    if(cpu_str) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(atoi(cpu_str), &cpus);
+        rc = pthread_setaffinity_np(gr_stub_thread, sizeof(cpus), &cpus);
+        if(rc) {
+            // sampling still works, only less predictably
+            fprintf(stderr, "Warning: cannot pin stub thread to cpu %s: %s\n",
+                cpu_str, strerror(rc));
+        }
+    }
+    return 0;
+}
+
 int gr_stub_init(int timer_interval, int num_locking)
 {
     // initialize monitor buffer
     timer_interval_us = timer_interval;
-    num_lock_tries = num_locking;
+    // num_locking is ignored, writing the monitor buffer never blocks
+    // 1% of the timer interval
+    snapshot_max_age = (uint64_t) timer_interval_us * 10;
+
+    char *temp_str = getenv("GR_STUB_SAMPLES");
+    if(temp_str) {
+        stub_target_samples = atoi(temp_str);
+    }
+    temp_str = getenv("GR_STUB_MIN_INTERVAL");
+    if(temp_str) {
+        stub_min_interval_ns = strtoull(temp_str, NULL, 10) * 1000;
+    }
+    temp_str = getenv("GR_STUB_MAX_INTERVAL");
+    if(temp_str) {
+        stub_max_interval_ns = strtoull(temp_str, NULL, 10) * 1000;
+    }
+    temp_str = getenv("GR_STUB_OVERHEAD");
+    if(temp_str) {
+        stub_max_overhead = atof(temp_str);
+    }
+    if(stub_min_interval_ns == 0) {
+        stub_min_interval_ns = 1000;
+    }
+    if(stub_max_interval_ns < stub_min_interval_ns) {
+        stub_max_interval_ns = stub_min_interval_ns;
+    }
 
     start_t.it_interval.tv_sec = 0;
     start_t.it_interval.tv_usec = 0;
@@ -81,6 +284,17 @@ int gr_stub_init(int timer_interval, int num_locking)
     end_t.it_value.tv_sec = 0;
     end_t.it_value.tv_usec = 0;
 
+    char *mode_str = getenv("GR_STUB_MODE");
+    if(mode_str && !strcmp(mode_str, "thread")) {
+        if(gr_perfctr_any_thread()) {
+            gr_stub_mode = GR_STUB_MODE_THREAD;
+            return gr_stub_start_thread();
+        }
+        fprintf(stderr, "Warning: the %s backend cannot be read by a stub thread, using SIGALRM\n",
+            gr_perfctr_backend_name() ? gr_perfctr_backend_name() : "disabled");
+    }
+    gr_stub_mode = GR_STUB_MODE_SIGNAL;
+
     // establish signal handler
     struct sigaction psa;
     psa.sa_handler = gr_timer_handler;
@@ -97,33 +311,162 @@ int gr_stub_init(int timer_interval, int num_locking)
 
 int gr_stub_finalize()
 {
+    if(gr_stub_mode == GR_STUB_MODE_THREAD) {
+        gr_stub_active = 0;
+        gr_stub_stop = 1;
+        gr_stub_wake();
+        pthread_join(gr_stub_thread, NULL);
+        return 0;
+    }
     disable_handler = 1;
     int rc = sigaction(SIGALRM, &old_sa, NULL);
     return rc;
 }
 
-int gr_stub_phase_start(long long *ptr)
+int gr_stub_phase_start(long long *ptr, uint64_t expected_length)
 {
+    uint64_t interval = gr_stub_interval(expected_length);
+    if(gr_stub_mode == GR_STUB_MODE_THREAD) {
+        // the sampling thread is not sampling, see gr_stub_phase_end()
+        memcpy(gr_stub_base, ptr, gr_perfctr_num_events() * sizeof(long long));
+        gr_stub_base_time = gr_clock_ns();
+        gr_stub_interval_ns = interval;
+        __atomic_store_n(&gr_stub_phase_count, gr_stub_phase_count + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&gr_stub_active, 1, __ATOMIC_SEQ_CST);
+        // a system call only if the thread went to sleep between phases
+        if(__atomic_load_n(&gr_stub_parked, __ATOMIC_SEQ_CST)) {
+            gr_stub_wake();
+        }
+        return 0;
+    }
+
+    if(expected_length > 0 && expected_length < interval) {
+        // would end before the first sample, spare the timer calls
+        return 0;
+    }
+    start_t.it_value.tv_sec = interval / 1000000000;
+    start_t.it_value.tv_usec = (interval % 1000000000) / 1000;
+
     // read performance counters into temp buffer
     old_pctr = perfctr_values1; 
     current_pctr = perfctr_values2;
     // here we try to avoid reading perf counter twice
-    int j;
-    for(j = 0; j < NUM_EVENTS; j ++) {
+    int j, num_events = gr_perfctr_num_events();
+    for(j = 0; j < num_events; j ++) {
         old_pctr[j] = ptr[j];
     } 
+    window_start = gr_clock_ns();
     disable_handler = 0;
 
     // setup timer
     setitimer(ITIMER_REAL, &start_t, NULL);
+    gr_stub_armed = 1;
     return 0;
 }
 
 int gr_stub_phase_end()
 {
+    if(gr_stub_mode == GR_STUB_MODE_THREAD) {
+        // wait for a sample in progress, it takes one counter read
+        __atomic_store_n(&gr_stub_active, 0, __ATOMIC_SEQ_CST);
+        int spins = 0;
+        while(__atomic_load_n(&gr_stub_busy, __ATOMIC_SEQ_CST)) {
+            if(++ spins % 1024 == 0) {
+                sched_yield();
+            }
+        }
+        return 0;
+    }
+
+    if(!gr_stub_armed) {
+        return 0;
+    }
     // disable timer
     disable_handler = 1;
     setitimer(ITIMER_REAL, &end_t, NULL);
+    gr_stub_armed = 0;
     return 0;
 }
 
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time arming and disarming ITIMER_REAL with SIGALRM blocked
+ */
+static void gr_stub_calibrate_timer(int rounds, uint64_t *arm_samples, uint64_t *disarm_samples)
+{
+    // a long interval, so the timer never expires while armed
+    struct itimerval long_t;
+    memset(&long_t, 0, sizeof(long_t));
+    long_t.it_value.tv_sec = 1;
+
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    int i;
+    for(i = 0; i < rounds; i ++) {
+        uint64_t t0 = gr_clock_ns_fenced();
+        setitimer(ITIMER_REAL, &long_t, NULL);
+        uint64_t t1 = gr_clock_ns_fenced();
+        setitimer(ITIMER_REAL, &end_t, NULL);
+        uint64_t t2 = gr_clock_ns_fenced();
+        arm_samples[i] = t1 - t0;
+        disarm_samples[i] = t2 - t1;
+    }
+    // drop a signal raised anyway, e.g. if the process was descheduled
+    sigset_t pending;
+    sigpending(&pending);
+    if(sigismember(&pending, SIGALRM)) {
+        int sig;
+        sigwait(&set, &sig);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
+
+int gr_stub_calibrate(int rounds, uint64_t *arm, uint64_t *disarm)
+{
+    uint64_t *arm_samples = (uint64_t *) malloc(2 * rounds * sizeof(uint64_t));
+    if(!arm_samples) {
+        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+        return -1;
+    }
+    uint64_t *disarm_samples = arm_samples + rounds;
+    int i;
+
+    if(gr_stub_mode == GR_STUB_MODE_THREAD) {
+        // the markers only flip flags; on a stand-in so nothing is sampled.
+        // Waking a parked thread is not counted, phases close together
+        // find it awake.
+        volatile int active = 0, busy = 0, parked = 0;
+        for(i = 0; i < rounds; i ++) {
+            uint64_t t0 = gr_clock_ns_fenced();
+            __atomic_store_n(&active, 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&parked, __ATOMIC_SEQ_CST)) {
+                break;
+            }
+            uint64_t t1 = gr_clock_ns_fenced();
+            __atomic_store_n(&active, 0, __ATOMIC_SEQ_CST);
+            while(__atomic_load_n(&busy, __ATOMIC_SEQ_CST));
+            uint64_t t2 = gr_clock_ns_fenced();
+            arm_samples[i] = t1 - t0;
+            disarm_samples[i] = t2 - t1;
+        }
+    }
+    else {
+        gr_stub_calibrate_timer(rounds, arm_samples, disarm_samples);
+    }
+
+    qsort(arm_samples, rounds, sizeof(uint64_t), compare_u64);
+    qsort(disarm_samples, rounds, sizeof(uint64_t), compare_u64);
+    *arm = arm_samples[rounds / 2];
+    *disarm = disarm_samples[rounds / 2];
+    free(arm_samples);
+    return 0;
+}
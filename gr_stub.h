@@ -1,17 +1,62 @@
 #ifndef _GR_STUB_H_
 #define _GR_STUB_H_
 
+#include <stdint.h>
+
 #define GR_DEFAULT_TIMER_INTERVAL 1000
 #define GR_DEFAULT_MONITOR_LOCKING 5
+#define GR_STUB_DEFAULT_SAMPLES 10 // aimed at per phase occurrence
+#define GR_STUB_DEFAULT_MIN_INTERVAL 100 // us
+#define GR_STUB_DEFAULT_MAX_INTERVAL 100000 // us
+#define GR_STUB_DEFAULT_OVERHEAD 0.01 // fraction of the time spent sampling
+
+/*
+ * How the stub samples a phase. With SIGALRM the markers arm and disarm
+ * ITIMER_REAL and the handler reads the counters on the main thread. With
+ * a thread, a sampling thread wakes up when a sample is due and reads the
+ * main thread's counters itself; the markers only flip a flag in memory.
+ * Between phases the thread sleeps, and a phase start wakes it with a
+ * futex if it is asleep.
+ */
+#define GR_STUB_MODE_SIGNAL 0
+#define GR_STUB_MODE_THREAD 1
+
+extern int gr_stub_mode;
+
+// time spent in the timer handler so far, in ns; 0 with a sampling thread
+extern volatile uint64_t gr_stub_time;
 
 void gr_timer_handler(int signum);
 
+/*
+ * Set up the stub. GR_STUB_MODE=thread selects a sampling thread, if the
+ * counter backend can be read from another thread (perf, sw); otherwise
+ * SIGALRM is used. GR_STUB_CPU pins the sampling thread to a CPU.
+ *
+ * Each phase is sampled about GR_STUB_SAMPLES times, at an interval
+ * between GR_STUB_MIN_INTERVAL and GR_STUB_MAX_INTERVAL us, and never so 
+ * often that sampling takes more than GR_STUB_OVERHEAD of the time. 
+ * Phases of unknown length, or all phases if GR_STUB_SAMPLES is 0, are
+ * sampled every timer_interval us.
+ */
 int gr_stub_init(int timer_interval, int num_locking);
 
 int gr_stub_finalize();
 
-int gr_stub_phase_start(long long *);
+/*
+ * Start sampling an outermost phase expected to last expected_length ns, 
+ * 0 if unknown, from the counter values it started with
+ */
+int gr_stub_phase_start(long long *ptr, uint64_t expected_length);
 
 int gr_stub_phase_end();
 
+/*
+ * Measure the median cost of arming and disarming the timer over the given
+ * number of rounds, in ns including one clock read. SIGALRM is blocked 
+ * meanwhile, the handler never runs. With a sampling thread, measure the
+ * flag updates of the markers instead.
+ */
+int gr_stub_calibrate(int rounds, uint64_t *arm, uint64_t *disarm);
+
 #endif
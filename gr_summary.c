@@ -0,0 +1,184 @@
+/**
+ * Column-wise phase statistics and batch kernels for derived metrics
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gr_perfctr.h"
+#include "gr_phase.h"
+#include "gr_summary.h"
+
+#define GR_SUMMARY_NUM_COLUMNS (5 + 3 * NUM_EVENTS)
+
+void gr_summary_ratio(int n, const double *restrict num, const double *restrict den,
+                      double scale, double *restrict out)
+{
+    int i;
+    for(i = 0; i < n; i ++) {
+        out[i] = (den[i] != 0) ? scale * num[i] / den[i] : 0;
+    }
+}
+
+void gr_summary_mul(int n, const double *restrict a, const double *restrict b, double *restrict out)
+{
+    int i;
+    for(i = 0; i < n; i ++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+double gr_summary_sum(int n, const double *restrict x)
+{
+    // four partial sums, so the loop vectorizes without reassociation
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i;
+    for(i = 0; i + 3 < n; i += 4) {
+        s0 += x[i];
+        s1 += x[i+1];
+        s2 += x[i+2];
+        s3 += x[i+3];
+    }
+    for(; i < n; i ++) {
+        s0 += x[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+/*
+ * Make room for num_phases phases. All columns share one allocation.
+ */
+static int gr_summary_reserve(gr_phase_summary_t s, int num_phases)
+{
+    if(num_phases <= s->capacity && s->count) {
+        return 0;
+    }
+    // round columns up to whole cache lines
+    int per_line = GR_CACHE_LINE_SIZE / sizeof(double);
+    int capacity = (num_phases + per_line - 1) / per_line * per_line;
+    if(capacity == 0) {
+        capacity = per_line;
+    }
+    double *block;
+    if(posix_memalign((void **) &block, GR_CACHE_LINE_SIZE,
+        (size_t) GR_SUMMARY_NUM_COLUMNS * capacity * sizeof(double))) {
+        fprintf(stderr, "Error: cannot allocate memory. %s:%d\n", __FILE__, __LINE__);
+        return -1;
+    }
+    free(s->count);
+    s->capacity = capacity;
+
+    int c = 0, e;
+    s->count = block + (c ++) * capacity;
+    s->length_mean = block + (c ++) * capacity;
+    s->ctr_count = block + (c ++) * capacity;
+    s->length_total = block + (c ++) * capacity;
+    s->ipc = block + (c ++) * capacity;
+    for(e = 0; e < NUM_EVENTS; e ++) {
+        s->ctr_sum[e] = block + (c ++) * capacity;
+        s->ctr_mean[e] = block + (c ++) * capacity;
+        s->ctr_rate[e] = block + (c ++) * capacity;
+    }
+    return 0;
+}
+
+/*
+ * Copy the phase table of ctx into the columns of s
+ */
+static void gr_summary_gather(gr_phase_summary_t s, gr_phase_ctx_t ctx)
+{
+    int n = ctx->num_phases;
+    int i;
+    for(i = 0; i < n; i ++) {
+        gr_phase_t p = gr_phase_at(ctx, i);
+        gr_phase_perf_t pp = gr_phase_perf_at(ctx, i);
+        s->count[i] = p->count;
+        s->length_mean[i] = pp->length_stats.mean;
+#ifdef GR_HAVE_PERFCTR
+        s->ctr_count[i] = pp->perf_counter.count;
+        int e;
+        for(e = 0; e < s->num_events; e ++) {
+            s->ctr_sum[e][i] = gr_perfctr_scaled_sum(&pp->perf_counter, e);
+        }
+#else
+        s->ctr_count[i] = 0;
+#endif
+    }
+}
+
+int gr_summary_build(gr_phase_summary_t s, gr_phase_ctx_t ctx)
+{
+    int n = ctx->num_phases;
+    if(gr_summary_reserve(s, n)) {
+        return -1;
+    }
+    s->num_phases = n;
+#ifdef GR_HAVE_PERFCTR
+    s->num_events = gr_perfctr_num_events();
+    if(s->num_events > NUM_EVENTS) {
+        s->num_events = NUM_EVENTS;
+    }
+    s->cyc_event = gr_perfctr_role_index(GR_ROLE_CYCLES);
+    s->ins_event = gr_perfctr_role_index(GR_ROLE_INSTRUCTIONS);
+#else
+    s->num_events = 0;
+    s->cyc_event = -1;
+    s->ins_event = -1;
+#endif
+    gr_summary_gather(s, ctx);
+
+    int e;
+    gr_summary_mul(n, s->count, s->length_mean, s->length_total);
+    s->total_count = gr_summary_sum(n, s->count);
+    s->total_length = gr_summary_sum(n, s->length_total);
+
+    for(e = 0; e < s->num_events; e ++) {
+        gr_summary_ratio(n, s->ctr_sum[e], s->ctr_count, 1, s->ctr_mean[e]);
+        s->total_ctr[e] = gr_summary_sum(n, s->ctr_sum[e]);
+    }
+    if(s->cyc_event != -1 && s->ins_event != -1) {
+        gr_summary_ratio(n, s->ctr_sum[s->ins_event], s->ctr_sum[s->cyc_event], 1, s->ipc);
+    }
+    else {
+        memset(s->ipc, 0, n * sizeof(double));
+    }
+
+    // rates are per 1000 instructions, e.g. cache misses give MPKI
+    int base = (s->ins_event != -1) ? s->ins_event : s->cyc_event;
+    for(e = 0; e < s->num_events; e ++) {
+        if(base == -1 || e == base) {
+            memset(s->ctr_rate[e], 0, n * sizeof(double));
+            continue;
+        }
+        gr_summary_ratio(n, s->ctr_sum[e], s->ctr_sum[base], 1000, s->ctr_rate[e]);
+    }
+    return 0;
+}
+
+void gr_summary_free(gr_phase_summary_t s)
+{
+    free(s->count);
+    memset(s, 0, sizeof(gr_phase_summary));
+}
+
+void gr_summary_print(FILE *log_file, gr_phase_summary_t s)
+{
+    int i, e;
+    int base = (s->ins_event != -1) ? s->ins_event : s->cyc_event;
+    fprintf(log_file, "\nDerived Metrics\n");
+    for(i = 0; i < s->num_phases; i ++) {
+        fprintf(log_file, "%d\t%.0f\t%.3f", i, s->length_total[i], s->ipc[i]);
+        for(e = 0; e < s->num_events; e ++) {
+            if(base == -1 || e == base) continue;
+            fprintf(log_file, "\t%s/k%s=%.3f", gr_perfctr_event_name(e),
+                gr_perfctr_event_name(base), s->ctr_rate[e][i]);
+        }
+        fprintf(log_file, "\n");
+    }
+    fprintf(log_file, "total\t%.0f\t%.0f", s->total_count, s->total_length);
+    for(e = 0; e < s->num_events; e ++) {
+        fprintf(log_file, "\t%s=%.0f", gr_perfctr_event_name(e), s->total_ctr[e]);
+    }
+    fprintf(log_file, "\n");
+}
+
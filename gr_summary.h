@@ -0,0 +1,64 @@
+#ifndef _GR_SUMMARY_H_
+#define _GR_SUMMARY_H_
+
+#include <stdio.h>
+#include "gr_perfctr.h"
+#include "gr_phase.h"
+
+/*
+ * Column-wise copy of the statistics of a phase table, with metrics derived
+ * from them. Each column is a cache line aligned array indexed by phase, so
+ * the batch kernels below run over all phases in one pass.
+ */
+typedef struct _gr_phase_summary {
+    int num_phases;
+    int capacity;
+    int num_events;
+
+    // gathered from the phase table
+    double *count;
+    double *length_mean;
+    double *ctr_count; // occurrences with counter values
+    double *ctr_sum[NUM_EVENTS]; // scaled to all ctr_count occurrences
+
+    // derived
+    double *length_total;
+    double *ctr_mean[NUM_EVENTS];
+    double *ipc; // instructions per cycle, if both are monitored
+    double *ctr_rate[NUM_EVENTS]; // events per 1000 instructions (or cycles)
+    int cyc_event; // index of the events with roles cycles and instructions, -1 if absent
+    int ins_event;
+
+    // totals over all phases
+    double total_count;
+    double total_length;
+    double total_ctr[NUM_EVENTS];
+} gr_phase_summary, *gr_phase_summary_t;
+
+/*
+ * Batch kernels over n phases
+ */
+
+/* out[i] = scale * num[i] / den[i], or 0 if den[i] is 0 */
+void gr_summary_ratio(int n, const double *num, const double *den, double scale, double *out);
+
+/* out[i] = a[i] * b[i] */
+void gr_summary_mul(int n, const double *a, const double *b, double *out);
+
+double gr_summary_sum(int n, const double *x);
+
+/*
+ * Gather the phase table of ctx into s and compute the derived metrics.
+ * s must be zeroed before first use and can be reused for later queries.
+ * For a live query ctx should be the calling thread's context.
+ *
+ * Return 0 on success, or -1 for error.
+ */
+int gr_summary_build(gr_phase_summary_t s, gr_phase_ctx_t ctx);
+
+void gr_summary_free(gr_phase_summary_t s);
+
+void gr_summary_print(FILE *log_file, gr_phase_summary_t s);
+
+#endif
+
@@ -1,46 +1,36 @@
 #ifndef __RDTSC_H_DEFINED__
 #define __RDTSC_H_DEFINED__
 
-#if 1
-//added by Chao
-#if 0
-#include <sys/time.h>
-#else 
+#include <stdint.h>
 #include <time.h>
-#endif 
+
+/*
+ * Raw tick counters
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+#define GR_HAVE_TSC 1
 
 static __inline__ unsigned long long rdtsc(void)
 {
-#if 0
-	unsigned long long ms;
-	struct timeval curtime;
-	gettimeofday(&curtime, 0);
-	ms = (unsigned long long) curtime.tv_sec * 1000000 + (unsigned long long) curtime.tv_usec;
-//	printf ("%lu\n", ms);
-	return ms;
-#else 
-	unsigned long long us;
-	us  = (unsigned long long)clock();
-	return us;
-#endif
+  unsigned hi, lo;
+  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
-#else
-
-#if defined(__i386__)
-
-static __inline__ unsigned long long rdtsc(void)
+/* rdtsc which waits for all earlier instructions to complete */
+static __inline__ unsigned long long rdtscp(void)
 {
-  unsigned long long int x;
-     __asm__ volatile (".byte 0x0f, 0x31" : "=A" (x));
-     return x;
+  unsigned hi, lo, aux;
+  __asm__ __volatile__ ("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+  return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
-#elif defined(__x86_64__)
 
-static __inline__ unsigned long long rdtsc(void)
+/* rdtsc which no earlier or later instruction is reordered across */
+static __inline__ unsigned long long rdtsc_fenced(void)
 {
   unsigned hi, lo;
-  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+  __asm__ __volatile__ ("lfence\n\trdtsc\n\tlfence" : "=a"(lo), "=d"(hi) :: "memory");
   return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
 }
 
@@ -66,14 +56,77 @@ static __inline__ unsigned long long rdtsc(void)
   return(result);
 }
 
-#else
+#endif
+
+/*
+ * Calibrated clock in nanoseconds. Phase lengths, GR_MIN_PHASE_LEN and
+ * timing breakdowns all use it. The TSC is used if it is invariant, i.e.
+ * ticks at a constant rate across frequency changes and idle states; 
+ * otherwise the clock falls back to CLOCK_MONOTONIC_RAW. Until 
+ * gr_clock_init() runs the fallback is used.
+ */
+#define GR_CLOCK_MONOTONIC_RAW 0
+#define GR_CLOCK_TSC 1
+
+#define GR_CLOCK_SHIFT 32
+
+typedef struct _gr_clock {
+    int source;
+    uint64_t tsc_base; // TSC value at calibration
+    uint64_t ns_base;  // CLOCK_MONOTONIC_RAW at tsc_base
+    uint64_t mult;     // ns per tick, fixed point with GR_CLOCK_SHIFT bits
+} gr_clock;
+
+extern gr_clock gr_clock_info;
 
-#error "No tick counter is available!"
+/*
+ * Detect and calibrate the clock source. GR_CLOCK=monotonic forces the
+ * fallback.
+ *
+ * Return 0 for success and -1 for error.
+ */
+int gr_clock_init();
 
+static __inline__ uint64_t gr_clock_raw_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef GR_HAVE_TSC
+static __inline__ uint64_t gr_clock_tsc_to_ns(uint64_t tsc)
+{
+    return gr_clock_info.ns_base + 
+        (uint64_t) (((unsigned __int128) (tsc - gr_clock_info.tsc_base) * 
+                     gr_clock_info.mult) >> GR_CLOCK_SHIFT);
+}
 #endif
-#endif 
 
+/* current time in ns */
+static __inline__ uint64_t gr_clock_ns(void)
+{
+#ifdef GR_HAVE_TSC
+    if(gr_clock_info.source == GR_CLOCK_TSC) {
+        return gr_clock_tsc_to_ns(rdtsc());
+    }
+#endif
+    return gr_clock_raw_ns();
+}
 
+/*
+ * Current time in ns, not reordered with the code around it. Used at 
+ * phase boundaries so the measured region is exactly the phase.
+ */
+static __inline__ uint64_t gr_clock_ns_fenced(void)
+{
+#ifdef GR_HAVE_TSC
+    if(gr_clock_info.source == GR_CLOCK_TSC) {
+        return gr_clock_tsc_to_ns(rdtsc_fenced());
+    }
+#endif
+    return gr_clock_raw_ns();
+}
 
 /*
  * Fortran interface